@@ -23,9 +23,7 @@
 
 #include <allegro.h>
 #include <cstdint>
-#include <memory>
 #include <vector>
-using std::shared_ptr;
 using std::vector;
 
 struct PACKFILE;
@@ -61,6 +59,10 @@ struct KBound
  * This contains an array of bounds, and the number of bounds, to simplify
  * passing around the size and elements separately.
  *
+ * Once the map size is known, Index() records which bound covers each
+ * tile, so looking up the bound a single tile is in does not have to go
+ * through them all.
+ *
  * \author OC
  * \date 20101017
  */
@@ -75,13 +77,13 @@ class KBounds
     }
 
     // Add a new bound to the map. Returns true on success, or false on failure.
-    bool Add(shared_ptr<KBound> bound);
+    bool Add(const KBound& bound);
 
     // Return a pointer to the bound at the given @param index. If index is
     // invalid, returns null.
-    shared_ptr<KBound> GetBound(size_t index);
+    const KBound* GetBound(size_t index) const;
 
-    size_t Size()
+    size_t Size() const
     {
         return m_bounds.size();
     }
@@ -98,6 +100,21 @@ class KBounds
      */
     bool IsBound(size_t& outIndex, int left, int top, int right, int bottom) const;
 
+    /*! \brief Build the per-tile lookup used by IsBound()
+     *
+     * Call this once all bounds have been added; adding another one drops
+     * the lookup again.
+     *
+     * \param   width - Width of the map in tiles
+     * \param   height - Height of the map in tiles
+     */
+    void Index(size_t width, size_t height);
+
   protected:
-    vector<shared_ptr<KBound>> m_bounds;
+    vector<KBound> m_bounds;
+
+    // For each tile of the map, the index+1 of the first bound covering it, or 0
+    vector<uint16_t> m_lookup;
+    size_t m_lookup_width = 0;
+    size_t m_lookup_height = 0;
 };
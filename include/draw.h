@@ -170,7 +170,7 @@ class KDraw
      * Helper function for the \sa draw_char routine.  Just returns whether or not
      * the tile at the specified co-ordinates is a forest tile.  This could be
      * a headache if the tileset changes!
-     * Looks in the \p map_seg[] array
+     * Looks at the background layer of the map
      * PH modified 20030309 added check for map (only main map has forest)
      *
      * \param   fx x-coord to check
@@ -396,6 +396,14 @@ class KDraw
      */
     void draw_char(int xw, int yw);
 
+    /*! \brief Draw one hero or NPC on the map, see draw_char()
+     *
+     * \param   fighter_index Index of the entity in g_ent[]
+     * \param   xw x-offset - always ==16
+     * \param   yw y-offset - always ==16
+     */
+    void draw_entity(size_t fighter_index, int xw, int yw);
+
     /*! \brief Draw foreground
      *
      * Draw the foreground layer.  Accounts for parallaxing.
@@ -78,6 +78,15 @@ class KEnemy
      */
     void CharmAction(size_t fighter_index);
 
+    /*! \brief Load all enemies from disk
+     *
+     * Loads up enemies from the *.mon files and fills the enemies[] array.
+     * Does nothing if they are already loaded. Called during startup so the
+     * first battle does not have to wait for it; it must not use strbuf
+     * because it may run on a worker thread.
+     */
+    void LoadEnemies();
+
   private:
     /*! \brief Melee attack
      *
@@ -172,12 +181,6 @@ class KEnemy
      */
     int SpellSetup(int whom, int z);
 
-    /*! \brief Load all enemies from disk
-     *
-     * Loads up enemies from the *.mon files and fills the enemies[] array.
-     */
-    void LoadEnemies();
-
     /*! \brief Unload the data loaded by load_enemies()
      *
      * JB would have said 'duh' here! Not much explanation required.
@@ -30,6 +30,7 @@
  */
 
 #include <cstdint>
+#include <vector>
 
 typedef uint32_t t_entity;
 
@@ -37,6 +38,9 @@ void process_entities(void);
 int entityat(int, int, t_entity);
 void set_script(t_entity, const char*);
 void place_ent(t_entity, int, int);
+void update_entity(t_entity);
+void sync_entities(void);
+const std::vector<t_entity>& active_entities(void);
 void count_entities(void);
 
 enum eCommands
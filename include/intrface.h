@@ -35,6 +35,41 @@ void do_luainit(const char* fname, int global);
 void do_luakill(void);
 void do_postexec(void);
 void do_importquests(void);
-void do_timefunc(const char* funcname);
 void do_zone(int zn_num);
 void lua_user_init(void);
+
+/*! \brief Carry on with script threads whose wait is over
+ *
+ * Map handlers run as Lua threads; wait(), wait_for_entity() and
+ * wait_enter() suspend them instead of blocking. Call this once per frame
+ * from the game loop.
+ *
+ * \param   ticks Game ticks processed since the last call
+ */
+void run_scripts(int ticks);
+
+/*! \brief Whether any script thread is still waiting */
+bool scripts_waiting(void);
+
+/*! \brief Call the timer function which is due next, if any
+ *
+ * Only one timer is run per call; any others which are due wait for the
+ * next one. Call this once per tick from the game loop.
+ */
+void run_timers(void);
+
+/*! \brief Cancel all pending timers */
+void reset_timers(void);
+
+/*! \brief Collect Lua garbage in time the frame would otherwise sleep through
+ *
+ * The collector doesn't run by itself, so its pauses can't land in the
+ * middle of a script. At least one step is taken if there is garbage to
+ * collect, even with no time to spare.
+ *
+ * \param   us Microseconds until the next frame is due
+ */
+void collect_script_garbage(long us);
+
+/*! \brief Memory used by the Lua VM, in kilobytes */
+int script_memory(void);
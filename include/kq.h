@@ -210,38 +210,13 @@ class KGame
      */
     void wait_for_entity(size_t first_entity_index, size_t last_entity_index);
 
-    /* \brief Get the next event if any
-     *
-     * Checks the pending events and returns the name
-     * of the next one, or NULL if nothing is ready
-     * to be triggered.
-     * If more than one event is ready, only one will be returned;
-     * the next one will be returned next time.
-     * Each event is removed after it is triggered. If a repeating
-     * event is desired, you should call add_timer_event() again
-     * in the handler function.
-     *
-     * \returns name of the next event or NULL if none is ready
-     */
-    char* get_timer_event(void);
-
-    /* \brief Add a new timer event to the list
-     *
-     * Up to five pending events can be stored
-     * at once.
-     * \param n the name of the event
-     * \param delta the number of seconds before the
-     *        event will be called. For example 5 means
-     *        five seconds in the future
-     * \returns <0 if an error occurred (i.e. too many pending events)
-     */
-    int add_timer_event(const char* n, int delta);
-
-    /*! \brief Delete any pending events
+    /*! \brief Whether any of a range of entities is still following a script
      *
-     * This removes any events from the list
+     * \param   first_entity_index First entity
+     * \param   last_entity_index Last entity
+     * \returns true if any of them is active and in MM_SCRIPT or MM_TARGET mode
      */
-    void reset_timer_events(void);
+    bool scripted_movement(size_t first_entity_index, size_t last_entity_index);
 
     /*! \brief Resets the world. Called every new game and load game
      *  This function may be called multiple times in some cases. That should be ok.
@@ -376,12 +351,6 @@ extern Raster *eframes[MAXE][MAXEFRAMES], *pgb[9], *sfonts[5], *bord[8];
 extern Raster *menuptr, *mptr, *sptr, *stspics, *sicons, *bptr, *missbmp, *noway, *upptr, *dnptr;
 extern Raster* shadow[MAX_SHADOWS];
 
-/*! Layers in the map */
-extern uint16_t *map_seg, *b_seg, *f_seg;
-
-/*! Zone, shadow and obstacle layers */
-extern uint8_t *z_seg, *s_seg, *o_seg;
-
 /*! Tasks completed */
 extern uint8_t progress[SIZE_PROGRESS];
 
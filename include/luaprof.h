@@ -0,0 +1,108 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+#pragma once
+
+/*! \file
+ * \brief Sampling profiler for the Lua scripts
+ */
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+struct lua_Debug;
+struct lua_State;
+struct luaL_Reg;
+
+/*! \brief Finds out where the scripts spend their time
+ *
+ * While running, a count hook samples the Lua call stack every
+ * SAMPLE_INSTRUCTIONS instructions and charges the time since the last
+ * sample to the function at the top (self time) and to every function on
+ * the stack (inclusive time). The C functions scripts call are swapped for
+ * wrappers which count the calls and time them.
+ *
+ * Report() writes a table sorted by time, plus the samples as collapsed
+ * stacks ("a;b;c count" lines) for flame graph tools.
+ */
+class KLuaProfiler
+{
+  public:
+    /*! \brief Start profiling
+     *
+     * \param   L The main Lua thread; threads created from it later are sampled too
+     * \param   bindings The engine's C functions, as registered in the globals;
+     *          must stay valid after Stop(), for wrappers scripts still hold
+     */
+    void Start(lua_State* L, const luaL_Reg* bindings);
+
+    /*! \brief Stop profiling and put the original C functions back
+     *
+     * What has been gathered is kept for Report().
+     * \param   L The main Lua thread
+     */
+    void Stop(lua_State* L);
+
+    /*! \brief Sample another thread which already exists */
+    void Attach(lua_State* thread);
+
+    bool IsRunning() const
+    {
+        return m_bindings != nullptr;
+    }
+
+    /*! \brief Write out and clear what has been gathered
+     *
+     * Does nothing if there is nothing to report.
+     * \param   name Goes in the file names, e.g. the map being left
+     */
+    void Report(const std::string& name);
+
+  private:
+    struct s_function_stats
+    {
+        unsigned long samples = 0;
+        double self_ms = 0.0;
+        double inclusive_ms = 0.0;
+    };
+    struct s_binding_stats
+    {
+        unsigned long calls = 0;
+        double inclusive_ms = 0.0;
+    };
+
+    static void Hook(lua_State* L, lua_Debug* ar);
+    static int CallBinding(lua_State* L);
+    void Sample(lua_State* L);
+
+    const luaL_Reg* m_bindings = nullptr; /*!< While running, the functions wrapped */
+    const luaL_Reg* m_wrapped = nullptr;  /*!< What the wrappers call, kept after Stop() */
+    std::chrono::steady_clock::time_point m_last_sample;
+    std::map<std::string, s_function_stats> m_functions;
+    std::map<std::string, unsigned long> m_stacks;
+    std::vector<s_binding_stats> m_calls;
+    std::vector<std::string> m_binding_names;
+};
+
+extern KLuaProfiler LuaProfiler;
@@ -0,0 +1,51 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#pragma once
+
+/*! \file
+ * \brief Compiled binary map cache (.kqmap files)
+ *
+ * After a TMX map has been parsed it is written out in a flat binary form
+ * to the user's cache directory. Later visits load that instead of parsing
+ * the XML again, as long as the TMX file (and any external tilesets it
+ * uses) still have the same size and modification time.
+ */
+
+#include <string>
+
+class tmx_map;
+
+/*! \brief Load a map from the cache.
+ *
+ * \param   source Full path of the TMX file
+ * \param   map Filled in on success
+ * \returns true if the cache was present and up to date
+ */
+bool load_map_cache(const std::string& source, tmx_map& map);
+
+/*! \brief Write a freshly parsed map to the cache.
+ *
+ * Failures are not fatal; the map will just be parsed again next time.
+ * \param   source Full path of the TMX file
+ * \param   map The map as loaded from the TMX file
+ */
+void save_map_cache(const std::string& source, const tmx_map& map);
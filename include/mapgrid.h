@@ -0,0 +1,250 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#pragma once
+
+/*! \file
+ * \brief Storage for the layers of the current map
+ *
+ * Each cell of the map has three tile layers (background, middle and
+ * foreground) plus zone, shadow and obstacle attributes.
+ *
+ * The grid keeps two copies of this, kept in step by every write:
+ * - interleaved: one KMapCell per tile, for code which looks at several
+ *   layers of the same cell (movement, zones, the diagonal draw fix-up);
+ * - per layer: a plain array per layer, for code which sweeps one layer
+ *   over many cells (the draw loops, "is this layer used" scans).
+ *
+ * Both are split into pages of MAP_PAGE_ROWS whole rows. Copying a grid
+ * only shares the pages; a page is copied the first time either grid
+ * changes it. So a pristine map can be kept as a template and each visit
+ * gets its own copy of just the pages its scripts change.
+ */
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*! \brief The layers held for each map cell */
+enum eMapLayer
+{
+    MAP_LAYER_BTILE = 0, /*!< Background tiles ("map" layer) */
+    MAP_LAYER_MTILE,     /*!< Middle tiles ("bmap" layer) */
+    MAP_LAYER_FTILE,     /*!< Foreground tiles ("fmap" layer) */
+    MAP_LAYER_ZONE,      /*!< Zone numbers */
+    MAP_LAYER_SHADOW,    /*!< Shadow index */
+    MAP_LAYER_OBSTACLE,  /*!< Obstacle type (BLOCK_*) */
+
+    NUM_MAP_LAYERS,
+    NUM_TILE_LAYERS = MAP_LAYER_ZONE
+};
+
+/*! Bit mask with every layer set, for KMapGrid::Copy() */
+static const unsigned int ALL_MAP_LAYERS = (1u << NUM_MAP_LAYERS) - 1;
+
+/*! \brief Everything known about one map cell */
+struct KMapCell
+{
+    uint16_t btile;   /*!< Background tile */
+    uint16_t mtile;   /*!< Middle tile */
+    uint16_t ftile;   /*!< Foreground tile */
+    uint8_t zone;     /*!< Zone number, 0 for none */
+    uint8_t shadow;   /*!< Shadow index, 0 for none */
+    uint8_t obstacle; /*!< One of the BLOCK_* values */
+};
+
+/*! Rows of the map in each copy-on-write page */
+static const int MAP_PAGE_ROWS = 16;
+
+/*! \brief All layers of a map
+ *
+ * Cells are addressed by (x, y). Cell(), the row accessors and Set() are
+ * unchecked (asserts only); the ...At() variants check the coordinates
+ * against the map.
+ *
+ * Copies of a grid share storage until one of them is changed.
+ */
+class KMapGrid
+{
+  public:
+    /*! \brief Discard the old map and make an empty one
+     *
+     * \param   width Width in tiles
+     * \param   height Height in tiles
+     */
+    void Resize(size_t width, size_t height);
+
+    /*! \brief Release all storage */
+    void Clear();
+
+    size_t Width() const
+    {
+        return m_width;
+    }
+    size_t Height() const
+    {
+        return m_height;
+    }
+
+    /*! \brief Whether the given coordinates are on the map */
+    bool InBounds(int x, int y) const
+    {
+        return x >= 0 && y >= 0 && static_cast<size_t>(x) < m_width && static_cast<size_t>(y) < m_height;
+    }
+
+    /*! \brief The cell at the given coordinates, unchecked */
+    const KMapCell& Cell(int x, int y) const
+    {
+        assert(InBounds(x, y));
+        return Page(y).cells[Offset(x, y)];
+    }
+
+    /*! \brief The cell at the given coordinates
+     * \returns the cell, or NULL if the coordinates are off the map
+     */
+    const KMapCell* CellAt(int x, int y) const
+    {
+        return InBounds(x, y) ? &Cell(x, y) : nullptr;
+    }
+
+    /*! \brief One row of a tile layer, as a plain array of Width() tiles */
+    const uint16_t* TileRow(eMapLayer layer, int y) const
+    {
+        assert(layer < NUM_TILE_LAYERS && y >= 0 && static_cast<size_t>(y) < m_height);
+        return Page(y).tiles[layer].data() + Offset(0, y);
+    }
+
+    /*! \brief One row of an attribute layer, as a plain array of Width() values */
+    const uint8_t* AttributeRow(eMapLayer layer, int y) const
+    {
+        assert(layer >= NUM_TILE_LAYERS && layer < NUM_MAP_LAYERS && y >= 0 && static_cast<size_t>(y) < m_height);
+        return Page(y).attributes[layer - NUM_TILE_LAYERS].data() + Offset(0, y);
+    }
+
+    /*! \brief Value of a layer at the given coordinates
+     * \returns the value, or 0 if the coordinates are off the map
+     */
+    int GetAt(eMapLayer layer, int x, int y) const;
+
+    /*! \brief Set a layer at the given coordinates, unchecked */
+    void Set(eMapLayer layer, int x, int y, int value);
+
+    /*! \brief Set a layer at the given coordinates
+     * \returns false (and does nothing) if the coordinates are off the map
+     */
+    bool SetAt(eMapLayer layer, int x, int y, int value);
+
+    /*! \brief Set one layer over a rectangle
+     *
+     * The rectangle is clipped to the map.
+     * \param   layer Which layer to change
+     * \param   x Left edge
+     * \param   y Top edge
+     * \param   w Width
+     * \param   h Height
+     * \param   value New value for every cell
+     */
+    void Fill(eMapLayer layer, int x, int y, int w, int h, int value);
+
+    /*! \brief Copy a rectangle of cells to somewhere else on the map
+     *
+     * Works like blit(): both rectangles are clipped to the map, and they
+     * may overlap.
+     * \param   sx Left edge of the source
+     * \param   sy Top edge of the source
+     * \param   dx Left edge of the destination
+     * \param   dy Top edge of the destination
+     * \param   w Width
+     * \param   h Height
+     * \param   layers Bit mask of (1 << eMapLayer) values to copy
+     */
+    void Copy(int sx, int sy, int dx, int dy, int w, int h, unsigned int layers = ALL_MAP_LAYERS);
+
+    /*! \brief Set one layer over a rectangle from an array of values
+     *
+     * The rectangle is clipped to the map; values for cells off the map
+     * are skipped.
+     * \param   layer Which layer to change
+     * \param   x Left edge
+     * \param   y Top edge
+     * \param   w Width
+     * \param   h Height
+     * \param   values w * h values, row by row
+     */
+    void Paste(eMapLayer layer, int x, int y, int w, int h, const int* values);
+
+    /*! \brief Fill a whole tile layer
+     *
+     * \param   layer One of the tile layers
+     * \param   data Width() * Height() tiles, row by row
+     */
+    void LoadTiles(eMapLayer layer, const uint16_t* data);
+
+    /*! \brief Fill a whole attribute layer
+     *
+     * \param   layer One of the zone, shadow or obstacle layers
+     * \param   data Width() * Height() values, row by row
+     */
+    void LoadAttributes(eMapLayer layer, const uint8_t* data);
+
+    /*! \brief Whether any cell has a non-zero value in the layer */
+    bool LayerUsed(eMapLayer layer) const;
+
+    /*! \brief Identifies the current contents of the obstacle layer
+     *
+     * Changes whenever the obstacle layer is written to, and is never the
+     * same for two different grids unless one is an unchanged copy of the
+     * other. So anything worked out from the obstacles can be kept for as
+     * long as this stays the same.
+     */
+    uint32_t ObstacleVersion() const
+    {
+        return m_obstacle_version;
+    }
+
+  private:
+    struct s_page
+    {
+        std::vector<KMapCell> cells;
+        std::vector<uint16_t> tiles[NUM_TILE_LAYERS];
+        std::vector<uint8_t> attributes[NUM_MAP_LAYERS - NUM_TILE_LAYERS];
+    };
+
+    const s_page& Page(int y) const
+    {
+        return *m_pages[y / MAP_PAGE_ROWS];
+    }
+    size_t Offset(int x, int y) const
+    {
+        return static_cast<size_t>(y % MAP_PAGE_ROWS) * m_width + x;
+    }
+    s_page& WritablePage(int y);
+    static void SyncCells(s_page& page, eMapLayer layer, size_t first, size_t count);
+    void ObstaclesChanged();
+
+    size_t m_width = 0;
+    size_t m_height = 0;
+    uint32_t m_obstacle_version = 0;
+    std::vector<std::shared_ptr<s_page>> m_pages;
+};
+
+extern KMapGrid MapGrid;
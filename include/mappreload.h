@@ -0,0 +1,104 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#pragma once
+
+/*! \file
+ * \brief Background loading of the maps the player is likely to visit next
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tiledmap.h"
+
+class KMarkers;
+
+/*! \brief Loads neighbouring maps on a background thread
+ *
+ * Whenever a map becomes current, the maps it can lead to are worked out
+ * (the targets of change_map() in its script, markers named after maps,
+ * and the map the player just came from). These are loaded and prepared
+ * in the background, so going through a door only has to swap them in.
+ *
+ * Only parsing and converting the map happens here; the music, the Lua
+ * script and everything else in prepare_map() still happen as usual.
+ */
+class KMapPreloader
+{
+  public:
+    ~KMapPreloader();
+
+    /*! \brief Start loading the neighbours of a map
+     *
+     * Anything preloaded which is not a neighbour of this map is dropped.
+     * \param   current Name of the map which has just become current
+     * \param   previous Name of the map before that
+     * \param   markers The current map's markers
+     */
+    void Anticipate(const std::string& current, const std::string& previous, const KMarkers& markers);
+
+    /*! \brief Collect a preloaded map
+     *
+     * Waits if the map is being loaded right now.
+     * \param   name Map to collect
+     * \param   map Filled in with the prepared map
+     * \returns true if the map was preloaded, false if it must be loaded as usual
+     */
+    bool Take(const std::string& name, tmx_map& map);
+
+    /*! \brief Stop the thread and drop everything preloaded */
+    void Stop();
+
+  private:
+    void Run();
+    std::vector<std::string> Neighbours(const std::string& current, const std::string& previous,
+                                        const std::vector<std::string>& markers) const;
+
+    std::thread m_thread;
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    bool m_stop = false;
+
+    // Bumped by every Anticipate() and Take(), so the thread can tell
+    // when the neighbours it has just worked out are out of date
+    unsigned int m_generation = 0;
+
+    // The latest request from Anticipate(), not yet looked at by the thread
+    bool m_requested = false;
+    std::string m_current;
+    std::string m_previous;
+    std::vector<std::string> m_markers;
+
+    // Neighbours of the current map, maps still to load, the one being
+    // loaded, and the ones ready to use
+    std::vector<std::string> m_wanted;
+    std::deque<std::string> m_queue;
+    std::string m_busy;
+    std::map<std::string, tmx_map> m_ready;
+};
+
+extern KMapPreloader MapPreloader;
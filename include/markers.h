@@ -24,6 +24,7 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 using std::shared_ptr;
 using std::string;
@@ -56,6 +57,15 @@ struct KMarker
     int32_t y;
 };
 
+/*! \brief The markers of a map
+ *
+ * Markers are indexed by name and by position, so scripts looking them up
+ * do not have to go through the whole list. Where several markers share a
+ * name or a position, the first one added is the one found.
+ *
+ * Copies of a KMarkers share the markers themselves; Move() gives the
+ * moved marker a copy of its own, so a kept map template is not changed.
+ */
 class KMarkers
 {
   public:
@@ -71,15 +81,19 @@ class KMarkers
 
     // Return a pointer to the marker at the given @param index. If index is
     // invalid, returns null.
-    shared_ptr<KMarker> GetMarker(size_t index);
+    shared_ptr<KMarker> GetMarker(size_t index) const;
 
     // Return a pointer to the marker that has the given @param name. If no
     // markers by that name are found, returns null.
-    shared_ptr<KMarker> GetMarker(string name);
+    shared_ptr<KMarker> GetMarker(const string& name) const;
 
     // Return a pointer to the marker whose @param x and @param y coordinates
     // match. If no marker is at those coordinates, returns null.
-    shared_ptr<KMarker> GetMarker(int32_t x, int32_t y);
+    shared_ptr<KMarker> GetMarker(int32_t x, int32_t y) const;
+
+    // Move the given @param marker to @param x, @param y. Returns the moved
+    // marker, which replaces the one passed in, or null if it is not here.
+    shared_ptr<KMarker> Move(shared_ptr<KMarker> marker, int32_t x, int32_t y);
 
     // Return the number of markers in the array.
     inline size_t Size() const
@@ -88,7 +102,18 @@ class KMarkers
     }
 
   protected:
+    void Reindex();
+
+    static uint64_t PositionKey(int32_t x, int32_t y)
+    {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(y);
+    }
+
     vector<shared_ptr<KMarker>> m_markers;
+
+    // Index into m_markers of the first marker with each name, and at each position
+    std::unordered_map<string, size_t> m_by_name;
+    std::unordered_map<uint64_t, size_t> m_by_position;
 };
 
 extern KMarker Marker;
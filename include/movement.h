@@ -24,3 +24,7 @@
 #include <cstdint>
 #include <cstdlib>
 int find_path(size_t, uint32_t, uint32_t, uint32_t, uint32_t, char*, uint32_t);
+bool set_obstacle(int, int, int);
+void update_regions(void);
+bool regions_current(void);
+void update_regions(int, int, int, int);
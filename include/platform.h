@@ -38,6 +38,7 @@ enum eDirectories
     MUSIC_DIR = 3,
     SCRIPT_DIR = 4,
     SETTINGS_DIR = 5,
+    CACHE_DIR = 6,
 };
 
 /* Get the directory for application data (music, gfx, etc.)
@@ -0,0 +1,55 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+#pragma once
+
+/*! \file
+ * \brief Compiled Lua script cache
+ *
+ * The first time a .lua script is loaded its compiled chunk is written to
+ * the user's cache directory. Later loads use that instead of parsing the
+ * source again, as long as the source has the same path, size and
+ * modification time and the cache came from the same Lua version. Scripts
+ * which are already compiled (.lob) are loaded as they are.
+ */
+
+#include <string>
+
+struct lua_State;
+
+/*! \brief Compile a script, from the cache if possible
+ *
+ * Leaves the compiled chunk on the stack as lua_load() does, or the error
+ * message if it fails.
+ * \param   L The Lua state
+ * \param   source Full path of the script
+ * \returns 0 on success, LUA_ERRFILE if the script can't be read, otherwise
+ *          the lua_load() error
+ */
+int load_cached_script(lua_State* L, const std::string& source);
+
+/*! \brief Fill the cache with every game script
+ *
+ * For --precompile-scripts. Reports each script on stdout.
+ * \returns true if every script compiled
+ */
+bool precompile_scripts(void);
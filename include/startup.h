@@ -0,0 +1,94 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+/*! \brief Dependency-ordered startup phases
+ *
+ * Each phase is a named task with a list of phases that must finish before
+ * it may start. Phases flagged as main-thread run on the caller (anything
+ * touching Allegro drivers, the screen or the sound card); the rest are
+ * spread over a small pool of worker threads.
+ *
+ * Every phase is timed (wall clock and CPU time of the thread that ran it)
+ * so a report can be printed afterwards.
+ */
+class KStartupTasks
+{
+  public:
+    typedef size_t TaskId;
+
+    /*! \brief Add a phase
+     *
+     * \param   name Short name used in the report
+     * \param   fn Work to do
+     * \param   deps Phases which must be complete first (must already be added)
+     * \param   main_thread Whether this phase must run on the calling thread
+     * \returns handle to use as a dependency of later phases
+     */
+    TaskId Add(const std::string& name, std::function<void()> fn, std::initializer_list<TaskId> deps = {},
+               bool main_thread = false);
+
+    /*! \brief Run all phases to completion
+     *
+     * \param   num_workers Number of worker threads; 0 runs everything on the caller
+     */
+    void Run(unsigned int num_workers);
+
+    /*! \brief Print per-phase timings
+     *
+     * \param   out Where to write the report
+     */
+    void Report(FILE* out) const;
+
+    /*! \brief Choose a worker count for this machine */
+    static unsigned int DefaultWorkers();
+
+  private:
+    struct s_task
+    {
+        std::string name;
+        std::function<void()> fn;
+        std::vector<TaskId> deps;
+        std::vector<TaskId> dependents;
+        size_t pending;
+        bool main_thread;
+        bool ran_on_main;
+        double start_ms;
+        double wall_ms;
+        double cpu_ms;
+    };
+
+    void Execute(s_task& task, bool on_main);
+
+    std::vector<s_task> m_tasks;
+    std::chrono::steady_clock::time_point m_origin;
+    double m_total_ms = 0.0;
+    unsigned int m_workers = 0;
+};
@@ -59,7 +59,7 @@ struct KQEntity
     uint8_t speed;    //!< How hyperactive the entity is
     uint8_t scount;
     uint8_t cmd;  //!< Scripted commands (eCommands in entity.h)
-    uint8_t sidx; //!< Index within script parser
+    uint8_t sidx; //!< Index of the next command of the compiled script
     uint8_t extra;
     uint8_t chasing;   //!< Entity is following another
     signed int cmdnum; //!< Number of times we need to repeat 'cmd'
@@ -22,7 +22,12 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <tinyxml2.h>
 #include <vector>
@@ -34,12 +39,24 @@ using namespace tinyxml2;
 
 #include "bounds.h"
 #include "entity.h"
+#include "mapgrid.h"
 #include "markers.h"
 #include "structs.h"
 #include "tmx_animation.h"
 #include "tmx_tileset.h"
 #include "zone.h"
 
+/*! \brief Releases memory from malloc().
+ * Layer data is malloc'd so it can be inflated straight into place.
+ */
+struct free_deleter
+{
+    void operator()(void* ptr) const
+    {
+        free(ptr);
+    }
+};
+
 class tmx_layer
 {
   public:
@@ -47,14 +64,27 @@ class tmx_layer
         : width(w)
         , height(h)
         , size(w * h)
-        , data(new uint32_t[size])
+        , data(static_cast<uint32_t*>(malloc(size * sizeof(uint32_t))))
     {
     }
+    tmx_layer(const tmx_layer& other)
+        : name(other.name)
+        , width(other.width)
+        , height(other.height)
+        , size(other.size)
+        , data(other.data ? static_cast<uint32_t*>(malloc(size * sizeof(uint32_t))) : nullptr)
+    {
+        if (data)
+        {
+            memcpy(data.get(), other.data.get(), size * sizeof(uint32_t));
+        }
+    }
+    tmx_layer(tmx_layer&&) = default;
     string name;
     const int width;
     const int height;
     const int size;
-    unique_ptr<uint32_t[]> data;
+    unique_ptr<uint32_t[], free_deleter> data;
 };
 
 class tmx_map
@@ -126,6 +156,13 @@ class tmx_map
     KMarkers markers;
     vector<KQEntity> entities;
     vector<tmx_layer> layers;
+
+    // The layers converted for the game, ready for set_current().
+    // Copies of a prepared map share this until one of them changes it.
+    KMapGrid grid;
+    bool prepared;
+
+    void prepare();
     void set_current();
     const KTmxTileset& find_tileset(const string&) const;
 };
@@ -134,6 +171,9 @@ class KTiledMap
 {
   public:
     void load_tmx(const string&);
+    bool preload_tmx(const string& name, tmx_map& map);
+    KTmxTileset load_tsx(const string& source);
+    Raster* tileset_image(const string& name);
 
   private:
     tmx_map load_tmx_map(XMLElement const* root);
@@ -144,9 +184,22 @@ class KTiledMap
     tmx_layer load_tmx_layer(XMLElement const* el);
     vector<KQEntity> load_tmx_entities(XMLElement const*);
     KTmxTileset load_tmx_tileset(XMLElement const*);
+    KTmxTileset parse_tileset(XMLElement const*);
     XMLElement const* find_objectgroup(XMLElement const* root, const char* name);
     vector<uint8_t> b64decode(const char*);
-    vector<uint8_t> uncompress(const vector<uint8_t>& data);
+    bool uncompress(const vector<uint8_t>& data, uint8_t* out, size_t size);
+    bool find_template(const string& name, tmx_map& map);
+    void add_template(const string& name, const tmx_map& map);
+
+    // External tilesets already loaded, by .tsx file name
+    std::map<string, KTmxTileset> tsx_registry;
+    // The preloader thread uses the registry too
+    std::mutex tsx_lock;
+
+    // Pristine prepared copies of recently loaded maps, most recent first.
+    // Their layers are shared with the map in play until a script changes it.
+    std::list<std::pair<string, tmx_map>> templates;
+    std::mutex template_lock;
 };
 
 extern KTiledMap TiledMap;
@@ -17,6 +17,7 @@ class KTmxTileset
 
     uint32_t firstgid;
     std::string name;
+    std::string source; //!< External .tsx file, or empty if embedded in the map
     std::string sourceimage;
     Raster* imagedata;
     std::vector<KTmxAnimation> animations;
@@ -25,6 +25,7 @@
  * \date 20060720
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cctype>
 #include <cmath>
@@ -34,17 +35,19 @@
 
 #include "bounds.h"
 
-bool KBounds::Add(shared_ptr<KBound> bound)
+bool KBounds::Add(const KBound& bound)
 {
     m_bounds.push_back(bound);
+    m_lookup.clear();
+    m_lookup_width = m_lookup_height = 0;
     return true;
 }
 
-shared_ptr<KBound> KBounds::GetBound(size_t index)
+const KBound* KBounds::GetBound(size_t index) const
 {
     if (index < m_bounds.size())
     {
-        return m_bounds[index];
+        return &m_bounds[index];
     }
     return nullptr;
 }
@@ -61,9 +64,22 @@ bool KBounds::IsBound(size_t& outIndex, int left, int top, int right, int bottom
         std::swap(top, bottom);
     }
 
+    // A single tile on the map can be looked up directly
+    if (left == right && top == bottom && left >= 0 && top >= 0 && static_cast<size_t>(left) < m_lookup_width &&
+        static_cast<size_t>(top) < m_lookup_height)
+    {
+        const uint16_t found = m_lookup[top * m_lookup_width + left];
+        if (found == 0)
+        {
+            return false;
+        }
+        outIndex = found - 1;
+        return true;
+    }
+
     for (size_t i = 0; i < m_bounds.size(); ++i)
     {
-        auto current_bound = m_bounds[i];
+        const KBound* current_bound = &m_bounds[i];
         if (left > current_bound->right || right < current_bound->left || top > current_bound->bottom ||
             bottom < current_bound->top)
         {
@@ -78,3 +94,37 @@ bool KBounds::IsBound(size_t& outIndex, int left, int top, int right, int bottom
 
     return false; // not found
 }
+
+void KBounds::Index(size_t width, size_t height)
+{
+    m_lookup.clear();
+    m_lookup_width = m_lookup_height = 0;
+    if (m_bounds.size() >= UINT16_MAX)
+    {
+        // Too many to number; IsBound() searches them all instead
+        return;
+    }
+
+    m_lookup.assign(width * height, 0);
+    m_lookup_width = width;
+    m_lookup_height = height;
+
+    // Fill in reverse so that where bounds overlap, the first one wins, as in a search
+    for (size_t i = m_bounds.size(); i > 0; --i)
+    {
+        const KBound& bound = m_bounds[i - 1];
+        if (bound.left > bound.right || bound.top > bound.bottom)
+        {
+            // The search never matches an inverted bound, so it gets no cells
+            continue;
+        }
+        const int x1 = std::max(bound.left, 0);
+        const int x2 = std::min<long>(bound.right, static_cast<long>(width) - 1);
+        const int y1 = std::max(bound.top, 0);
+        const int y2 = std::min<long>(bound.bottom, static_cast<long>(height) - 1);
+        for (int y = y1; y <= y2; ++y)
+        {
+            std::fill_n(m_lookup.begin() + y * width + x1, std::max(x2 - x1 + 1, 0), static_cast<uint16_t>(i));
+        }
+    }
+}
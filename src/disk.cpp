@@ -930,6 +930,7 @@ int KDisk::load_general_props_xml(XMLElement* node)
                         g_ent[i].active = 0;
                     }
                 }
+                sync_entities();
             }
             // Don't need to restore anything from <sgstats>
         }
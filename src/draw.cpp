@@ -41,8 +41,10 @@
 #include "entity.h"
 #include "gfx.h"
 #include "input.h"
+#include "intrface.h"
 #include "kq.h"
 #include "magic.h"
+#include "mapgrid.h"
 #include "music.h"
 #include "player.h"
 #include "res.h"
@@ -101,6 +103,13 @@ void KDraw::blit2screen(int xw, int yw)
         }
         double_buffer->fill(xw, yw, xw + 24, yw + 8, 0);
         print_font(double_buffer, xw, yw, fbuf, FNORMAL);
+#ifdef DEBUGMODE
+        // Memory used by the scripts
+        char mbuf[16];
+        sprintf(mbuf, "%5dK", script_memory());
+        double_buffer->fill(xw + 32, yw, xw + 80, yw + 8, 0);
+        print_font(double_buffer, xw + 32, yw, mbuf, FNORMAL);
+#endif
     }
 #ifdef DEBUGMODE
     display_console(xw, yw);
@@ -262,7 +271,6 @@ void KDraw::recalculate_offsets(int dx, int dy)
 void KDraw::draw_backlayer(void)
 {
     int dx, dy, pix, xtc, ytc;
-    int here;
     KBound box;
 
     if (view_on == 0)
@@ -301,13 +309,13 @@ void KDraw::draw_backlayer(void)
         /* TT Parallax problem here #1 */
         if (ytc + dy >= box.top && ytc + dy <= box.bottom)
         {
+            const uint16_t* btiles = MapGrid.TileRow(MAP_LAYER_BTILE, ytc + dy);
             for (dx = 0; dx < 21; dx++)
             {
                 /* TT Parallax problem here #2 */
                 if (xtc + dx >= box.left && xtc + dx <= box.right)
                 {
-                    here = ((ytc + dy) * g_map.xsize) + xtc + dx;
-                    pix = map_seg[here];
+                    pix = btiles[xtc + dx];
                     blit(map_icons[tilex[pix]], double_buffer, 0, 0, dx * 16 + xofs, dy * 16 + yofs, 16, 16);
                 }
             }
@@ -316,176 +324,193 @@ void KDraw::draw_backlayer(void)
 }
 
 void KDraw::draw_char(int xw, int yw)
+{
+    const std::vector<t_entity>& live = active_entities();
+
+    /* Draw from the highest index down, so the heroes end up on top */
+    for (auto entity_index = live.rbegin(); entity_index != live.rend(); ++entity_index)
+    {
+        if (*entity_index >= PSIZE && *entity_index < PSIZE + number_of_entities)
+        {
+            draw_entity(*entity_index, xw, yw);
+        }
+    }
+    for (size_t fighter_index = PSIZE; fighter_index > 0; fighter_index--)
+    {
+        draw_entity(fighter_index - 1, xw, yw);
+    }
+}
+
+void KDraw::draw_entity(size_t fighter_index, int xw, int yw)
 {
     signed int dx, dy;
     int f;
     int x, y;
     signed int horiz, vert;
-    unsigned int here, there;
+    int here_x, here_y, there_x, there_y;
     Raster** sprite_base;
     Raster* spr = NULL;
-    size_t follower_fighter_index;
-    size_t fighter_index;
     size_t fighter_frame, fighter_frame_add;
     size_t fighter_type_id;
 
-    for (follower_fighter_index = PSIZE + number_of_entities; follower_fighter_index > 0; follower_fighter_index--)
+    fighter_type_id = g_ent[fighter_index].eid;
+    dx = g_ent[fighter_index].x - viewport_x_coord + xw;
+    dy = g_ent[fighter_index].y - viewport_y_coord + yw;
+    if (!g_ent[fighter_index].moving)
+    {
+        fighter_frame = g_ent[fighter_index].facing * ENT_FRAMES_PER_DIR + 2;
+    }
+    else
+    {
+        fighter_frame_add = g_ent[fighter_index].framectr > 10 ? 1 : 0;
+        fighter_frame = g_ent[fighter_index].facing * ENT_FRAMES_PER_DIR + fighter_frame_add;
+    }
+    if (fighter_index < PSIZE && fighter_index < numchrs)
     {
-        fighter_index = follower_fighter_index - 1;
-        fighter_type_id = g_ent[fighter_index].eid;
-        dx = g_ent[fighter_index].x - viewport_x_coord + xw;
-        dy = g_ent[fighter_index].y - viewport_y_coord + yw;
-        if (!g_ent[fighter_index].moving)
+        /* It's a hero */
+        /* Masquerade: if chrx!=0 then this hero is disguised as someone else...
+         */
+        sprite_base = g_ent[fighter_index].chrx ? eframes[g_ent[fighter_index].chrx] : frames[fighter_type_id];
+
+        if (party[fighter_type_id].IsDead())
         {
             fighter_frame = g_ent[fighter_index].facing * ENT_FRAMES_PER_DIR + 2;
         }
+        if (party[fighter_type_id].IsPoisoned())
+        {
+            /* PH: we are calling this every frame? */
+            color_scale(sprite_base[fighter_frame], tc2, 32, 47);
+            spr = tc2;
+        }
         else
         {
-            fighter_frame_add = g_ent[fighter_index].framectr > 10 ? 1 : 0;
-            fighter_frame = g_ent[fighter_index].facing * ENT_FRAMES_PER_DIR + fighter_frame_add;
+            spr = sprite_base[fighter_frame];
         }
-        if (fighter_index < PSIZE && fighter_index < numchrs)
+        if (is_forestsquare(g_ent[fighter_index].tilex, g_ent[fighter_index].tiley))
         {
-            /* It's a hero */
-            /* Masquerade: if chrx!=0 then this hero is disguised as someone else...
-             */
-            sprite_base = g_ent[fighter_index].chrx ? eframes[g_ent[fighter_index].chrx] : frames[fighter_type_id];
-
-            if (party[fighter_type_id].IsDead())
+            f = !g_ent[fighter_index].moving;
+            if (g_ent[fighter_index].moving &&
+                is_forestsquare(g_ent[fighter_index].x / TILE_W, g_ent[fighter_index].y / TILE_H))
             {
-                fighter_frame = g_ent[fighter_index].facing * ENT_FRAMES_PER_DIR + 2;
+                f = 1;
             }
-            if (party[fighter_type_id].IsPoisoned())
+            if (f)
             {
-                /* PH: we are calling this every frame? */
-                color_scale(sprite_base[fighter_frame], tc2, 32, 47);
-                spr = tc2;
+                clear_to_color(tc, 0);
+                blit(spr, tc, 0, 0, 0, 0, 16, 6);
+                spr = tc;
             }
-            else
+        }
+
+        if (party[fighter_type_id].IsAlive())
+        {
+            draw_sprite(double_buffer, spr, dx, dy);
+        }
+        else
+        {
+            draw_trans_sprite(double_buffer, spr, dx, dy);
+        }
+
+        /* After we draw the player's character, we have to know whether they
+         * are moving diagonally. If so, we need to draw both layers 1&2 on
+         * the correct tile, which helps correct diagonal movement artifacts.
+         * We also need to ensure that the target coords has SOMETHING in the
+         * obstacle layer, else there will be graphical glitches.
+         */
+        if (fighter_index == 0 && g_ent[0].moving)
+        {
+            horiz = 0;
+            vert = 0;
+            /* Determine the direction moving */
+
+            if (g_ent[fighter_index].tilex * TILE_W > g_ent[fighter_index].x)
             {
-                spr = sprite_base[fighter_frame];
+                horiz = 1; // Right
             }
-            if (is_forestsquare(g_ent[fighter_index].tilex, g_ent[fighter_index].tiley))
+            else if (g_ent[fighter_index].tilex * TILE_W < g_ent[fighter_index].x)
             {
-                f = !g_ent[fighter_index].moving;
-                if (g_ent[fighter_index].moving &&
-                    is_forestsquare(g_ent[fighter_index].x / TILE_W, g_ent[fighter_index].y / TILE_H))
-                {
-                    f = 1;
-                }
-                if (f)
-                {
-                    clear_to_color(tc, 0);
-                    blit(spr, tc, 0, 0, 0, 0, 16, 6);
-                    spr = tc;
-                }
+                horiz = -1; // Left
             }
 
-            if (party[fighter_type_id].IsAlive())
+            if (g_ent[fighter_index].tiley * TILE_H > g_ent[fighter_index].y)
             {
-                draw_sprite(double_buffer, spr, dx, dy);
+                vert = 1; // Down
             }
-            else
+            else if (g_ent[fighter_index].tiley * TILE_H < g_ent[fighter_index].y)
             {
-                draw_trans_sprite(double_buffer, spr, dx, dy);
+                vert = -1; // Up
             }
 
-            /* After we draw the player's character, we have to know whether they
-             * are moving diagonally. If so, we need to draw both layers 1&2 on
-             * the correct tile, which helps correct diagonal movement artifacts.
-             * We also need to ensure that the target coords has SOMETHING in the
-             * o_seg[] portion, else there will be graphical glitches.
-             */
-            if (fighter_index == 0 && g_ent[0].moving)
+            /* Moving diagonally means both horiz and vert are non-zero */
+            if (horiz && vert)
             {
-                horiz = 0;
-                vert = 0;
-                /* Determine the direction moving */
-
-                if (g_ent[fighter_index].tilex * TILE_W > g_ent[fighter_index].x)
-                {
-                    horiz = 1; // Right
-                }
-                else if (g_ent[fighter_index].tilex * TILE_W < g_ent[fighter_index].x)
-                {
-                    horiz = -1; // Left
-                }
-
-                if (g_ent[fighter_index].tiley * TILE_H > g_ent[fighter_index].y)
+                /* When moving down, we will draw over the spot directly below
+                 * our starting position. Since tile[xy] shows our final coord,
+                 * we will instead draw to the left or right of the final pos.
+                 */
+                if (vert > 0)
                 {
-                    vert = 1; // Down
+                    /* Moving diag down */
+
+                    // Final x-coord is one left/right of starting x-coord
+                    x = (g_ent[fighter_index].tilex - horiz) * TILE_W - viewport_x_coord + xw;
+                    // Final y-coord is same as starting y-coord
+                    y = g_ent[fighter_index].tiley * TILE_H - viewport_y_coord + yw;
+                    // Where the tile is on the map that we will draw over
+                    there_x = g_ent[fighter_index].tilex - horiz;
+                    there_y = g_ent[fighter_index].tiley;
+                    // Original position, before you started moving
+                    here_x = g_ent[fighter_index].tilex - horiz;
+                    here_y = g_ent[fighter_index].tiley - vert;
                 }
-                else if (g_ent[fighter_index].tiley * TILE_H < g_ent[fighter_index].y)
+                else
                 {
-                    vert = -1; // Up
+                    /* Moving diag up */
+
+                    // Final x-coord is same as starting x-coord
+                    x = g_ent[fighter_index].tilex * TILE_W - viewport_x_coord + xw;
+                    // Final y-coord is above starting y-coord
+                    y = (g_ent[fighter_index].tiley - vert) * TILE_H - viewport_y_coord + yw;
+                    // Where the tile is on the map that we will draw over
+                    there_x = g_ent[fighter_index].tilex;
+                    there_y = g_ent[fighter_index].tiley - vert;
+                    // Target position
+                    here_x = g_ent[fighter_index].tilex;
+                    here_y = g_ent[fighter_index].tiley;
                 }
 
-                /* Moving diagonally means both horiz and vert are non-zero */
-                if (horiz && vert)
+                /* Because of possible redraw problems, only draw if there is
+                 * something drawn over the player (foreground tile != 0)
+                 */
+                if (tilex[MapGrid.Cell(here_x, here_y).ftile] != 0)
                 {
-                    /* When moving down, we will draw over the spot directly below
-                     * our starting position. Since tile[xy] shows our final coord,
-                     * we will instead draw to the left or right of the final pos.
-                     */
-                    if (vert > 0)
-                    {
-                        /* Moving diag down */
-
-                        // Final x-coord is one left/right of starting x-coord
-                        x = (g_ent[fighter_index].tilex - horiz) * TILE_W - viewport_x_coord + xw;
-                        // Final y-coord is same as starting y-coord
-                        y = g_ent[fighter_index].tiley * TILE_H - viewport_y_coord + yw;
-                        // Where the tile is on the map that we will draw over
-                        there = (g_ent[fighter_index].tiley) * g_map.xsize + g_ent[fighter_index].tilex - horiz;
-                        // Original position, before you started moving
-                        here = (g_ent[fighter_index].tiley - vert) * g_map.xsize + g_ent[fighter_index].tilex - horiz;
-                    }
-                    else
-                    {
-                        /* Moving diag up */
-
-                        // Final x-coord is same as starting x-coord
-                        x = g_ent[fighter_index].tilex * TILE_W - viewport_x_coord + xw;
-                        // Final y-coord is above starting y-coord
-                        y = (g_ent[fighter_index].tiley - vert) * TILE_H - viewport_y_coord + yw;
-                        // Where the tile is on the map that we will draw over
-                        there = (g_ent[fighter_index].tiley - vert) * g_map.xsize + g_ent[fighter_index].tilex;
-                        // Target position
-                        here = (g_ent[fighter_index].tiley) * g_map.xsize + g_ent[fighter_index].tilex;
-                    }
-
-                    /* Because of possible redraw problems, only draw if there is
-                     * something drawn over the player (f_seg[] != 0)
-                     */
-                    if (tilex[f_seg[here]] != 0)
-                    {
-                        draw_sprite(double_buffer, map_icons[tilex[map_seg[there]]], x, y);
-                        draw_sprite(double_buffer, map_icons[tilex[b_seg[there]]], x, y);
-                    }
+                    const KMapCell& cell = MapGrid.Cell(there_x, there_y);
+                    draw_sprite(double_buffer, map_icons[tilex[cell.btile]], x, y);
+                    draw_sprite(double_buffer, map_icons[tilex[cell.mtile]], x, y);
                 }
             }
         }
-        else
+    }
+    else
+    {
+        /* It's an NPC */
+        if (g_ent[fighter_index].active && g_ent[fighter_index].tilex >= view_x1 &&
+            g_ent[fighter_index].tilex <= view_x2 && g_ent[fighter_index].tiley >= view_y1 &&
+            g_ent[fighter_index].tiley <= view_y2)
         {
-            /* It's an NPC */
-            if (g_ent[fighter_index].active && g_ent[fighter_index].tilex >= view_x1 &&
-                g_ent[fighter_index].tilex <= view_x2 && g_ent[fighter_index].tiley >= view_y1 &&
-                g_ent[fighter_index].tiley <= view_y2)
+            if (dx >= TILE_W * -1 && dx <= TILE_W * (ONSCREEN_TILES_W + 1) && dy >= TILE_H * -1 &&
+                dy <= TILE_H * (ONSCREEN_TILES_H + 1))
             {
-                if (dx >= TILE_W * -1 && dx <= TILE_W * (ONSCREEN_TILES_W + 1) && dy >= TILE_H * -1 &&
-                    dy <= TILE_H * (ONSCREEN_TILES_H + 1))
-                {
-                    spr = (g_ent[fighter_index].eid >= ID_ENEMY) ? eframes[g_ent[fighter_index].chrx][fighter_frame]
-                                                                 : frames[g_ent[fighter_index].eid][fighter_frame];
+                spr = (g_ent[fighter_index].eid >= ID_ENEMY) ? eframes[g_ent[fighter_index].chrx][fighter_frame]
+                                                             : frames[g_ent[fighter_index].eid][fighter_frame];
 
-                    if (g_ent[fighter_index].transl == 0)
-                    {
-                        draw_sprite(double_buffer, spr, dx, dy);
-                    }
-                    else
-                    {
-                        draw_trans_sprite(double_buffer, spr, dx, dy);
-                    }
+                if (g_ent[fighter_index].transl == 0)
+                {
+                    draw_sprite(double_buffer, spr, dx, dy);
+                }
+                else
+                {
+                    draw_trans_sprite(double_buffer, spr, dx, dy);
                 }
             }
         }
@@ -495,7 +520,6 @@ void KDraw::draw_char(int xw, int yw)
 void KDraw::draw_forelayer(void)
 {
     int dx, dy, pix, xtc, ytc;
-    int here;
     KBound box;
 
     if (view_on == 0)
@@ -532,64 +556,65 @@ void KDraw::draw_forelayer(void)
     {
         if (ytc + dy >= box.top && ytc + dy <= box.bottom)
         {
+            const uint16_t* ftiles = MapGrid.TileRow(MAP_LAYER_FTILE, ytc + dy);
             for (dx = 0; dx < 21; dx++)
             {
                 if (xtc + dx >= box.left && xtc + dx <= box.right)
                 {
-                    // Used in several places in this loop, so shortened the name
-                    here = ((ytc + dy) * g_map.xsize) + xtc + dx;
-                    pix = f_seg[here];
+                    pix = ftiles[xtc + dx];
                     draw_sprite(double_buffer, map_icons[tilex[pix]], dx * 16 + xofs, dy * 16 + yofs);
 
 #ifdef DEBUGMODE
                     if (debugging > 3)
                     {
+                        const KMapCell& cell = MapGrid.Cell(xtc + dx, ytc + dy);
+
                         // Obstacles
-                        if (o_seg[here] == 1)
+                        if (cell.obstacle == 1)
                         {
                             draw_sprite(double_buffer, obj_mesh, dx * 16 + xofs, dy * 16 + yofs);
                         }
 
                         // Zones
 #if (ALLEGRO_VERSION >= 4 && ALLEGRO_SUB_VERSION >= 1)
-                        if (z_seg[here] == 0)
+                        if (cell.zone == 0)
                         {
                             // Do nothing
                         }
                         else
                         {
                             char buf[8];
-                            sprintf(buf, "%d", z_seg[here]);
+                            sprintf(buf, "%d", cell.zone);
                             size_t l = strlen(buf) * 8;
                             print_num(double_buffer, dx * 16 + 8 + xofs - l / 2, dy * 16 + 4 + yofs, buf, FONT_WHITE);
                         }
 #else
-                        if (z_seg[here] == 0)
+                        if (cell.zone == 0)
                         {
                             // Do nothing
                         }
-                        else if (z_seg[here] < 10)
+                        else if (cell.zone < 10)
                         {
                             /* The zone's number is single-digit, center vert+horiz */
                             textprintf(double_buffer, font, dx * 16 + 4 + xofs, dy * 16 + 4 + yofs,
-                                       makecol(255, 255, 255), "%d", z_seg[here]);
+                                       makecol(255, 255, 255), "%d", cell.zone);
                         }
-                        else if (z_seg[here] < 100)
+                        else if (cell.zone < 100)
                         {
                             /* The zone's number is double-digit, center only vert */
                             textprintf(double_buffer, font, dx * 16 + xofs, dy * 16 + 4 + yofs, makecol(255, 255, 255),
-                                       "%d", z_seg[here]);
+                                       "%d", cell.zone);
                         }
-                        else if (z_seg[here] < 10)
+                        else if (cell.zone < 10)
                         {
                             /* The zone's number is triple-digit.  Print the 100's
                              * digit in top-center of the square; the 10's and 1's
                              * digits on bottom of the square
                              */
                             textprintf(double_buffer, font, dx * 16 + 4 + xofs, dy * 16 + yofs, makecol(255, 255, 255),
-                                       "%d", (int)(z_seg[here] / 100));
+                                       "%d", (int)(cell.zone / 100));
                             textprintf(double_buffer, font, dx * 16 + xofs, dy * 16 + 8 + yofs, makecol(255, 255, 255),
-                                       "%02d", (int)(z_seg[here] % 100));
+                                       "%02d", (int)(cell.zone % 100));
                         }
 #endif /* (ALLEGRO_VERSION) */
                     }
@@ -656,7 +681,6 @@ void KDraw::draw_kq_box(Raster* where, int x1, int y1, int x2, int y2, int bg, e
 void KDraw::draw_midlayer(void)
 {
     int dx, dy, pix, xtc, ytc;
-    int here;
     KBound box;
 
     if (view_on == 0)
@@ -694,12 +718,12 @@ void KDraw::draw_midlayer(void)
     {
         if (ytc + dy >= box.top && ytc + dy <= box.bottom)
         {
+            const uint16_t* mtiles = MapGrid.TileRow(MAP_LAYER_MTILE, ytc + dy);
             for (dx = 0; dx < 21; dx++)
             {
                 if (xtc + dx >= box.left && xtc + dx <= box.right)
                 {
-                    here = ((ytc + dy) * g_map.xsize) + xtc + dx;
-                    pix = b_seg[here];
+                    pix = mtiles[xtc + dx];
                     draw_sprite(double_buffer, map_icons[tilex[pix]], dx * 16 + xofs, dy * 16 + yofs);
                 }
             }
@@ -710,7 +734,7 @@ void KDraw::draw_midlayer(void)
 void KDraw::draw_playerbound(void)
 {
     int dx, dy, xtc, ytc;
-    shared_ptr<KBound> found = nullptr;
+    const KBound* found = nullptr;
     uint16_t ent_x = g_ent[0].tilex;
     uint16_t ent_y = g_ent[0].tiley;
 
@@ -774,7 +798,6 @@ void KDraw::draw_playerbound(void)
 void KDraw::draw_shadows(void)
 {
     int dx, dy, pix, xtc, ytc;
-    int here;
 
     if (draw_shadow == 0)
     {
@@ -793,12 +816,16 @@ void KDraw::draw_shadows(void)
 
     for (dy = 0; dy < 16; dy++)
     {
+        if (ytc + dy < view_y1 || ytc + dy > view_y2)
+        {
+            continue;
+        }
+        const uint8_t* shadows = MapGrid.AttributeRow(MAP_LAYER_SHADOW, ytc + dy);
         for (dx = 0; dx < 21; dx++)
         {
-            if (ytc + dy >= view_y1 && xtc + dx >= view_x1 && ytc + dy <= view_y2 && xtc + dx <= view_x2)
+            if (xtc + dx >= view_x1 && xtc + dx <= view_x2)
             {
-                here = ((ytc + dy) * g_map.xsize) + xtc + dx;
-                pix = s_seg[here];
+                pix = shadows[xtc + dx];
                 if (pix > 0)
                 {
                     draw_trans_sprite(double_buffer, shadow[pix], dx * 16 + xofs, dy * 16 + yofs);
@@ -993,7 +1020,7 @@ int KDraw::is_forestsquare(int fx, int fy)
     {
         return 0;
     }
-    auto mapseg = map_seg[(fy * g_map.xsize) + fx];
+    auto mapseg = MapGrid.GetAt(MAP_LAYER_BTILE, fx, fy);
     switch (mapseg)
     {
     case 63:
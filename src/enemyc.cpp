@@ -636,8 +636,7 @@ void KEnemy::LoadEnemies(const string& fullPath, Raster* enemy_gfx)
         KFighter fighter_loaded_from_disk;
 
         // Enemy name
-        iss >> strbuf;
-        fighter_loaded_from_disk.name = strbuf;
+        iss >> fighter_loaded_from_disk.name;
 
         // Index number (ignored; automatically generated)
         iss >> tmp;
@@ -731,8 +730,9 @@ void KEnemy::LoadEnemyStats(const string& fullFilename)
     {
         KFighter& fighter_loaded_from_disk = m_enemy_fighters[current_enemy];
         std::istringstream iss(line);
+        string name;
 
-        iss >> strbuf;
+        iss >> name;
 
         // Some index: ignored
         iss >> tmp;
@@ -26,6 +26,7 @@
  * \date ??????
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cctype>
 #include <cmath>
@@ -33,6 +34,10 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "combat.h"
 #include "entity.h"
@@ -41,6 +46,7 @@
 #include "intrface.h"
 #include "itemdefs.h"
 #include "kq.h"
+#include "mapgrid.h"
 #include "menu.h"
 #include "random.h"
 #include "setup.h"
@@ -53,13 +59,74 @@ static void follow(int, int);
 static void getcommand(t_entity);
 static int move(t_entity, int, int);
 static int obstruction(int, int, int, int, int);
-static void parsems(t_entity);
 static void player_move(void);
 static void process_entity(t_entity);
 static void speed_adjust(t_entity);
 static void target(t_entity);
 static void wander(t_entity);
 
+/*! \brief Which entities stand on each map cell
+ *
+ * Each cell holds a list of the active entities whose tile it is, in
+ * increasing index order, so "who is here" is a lookup rather than a walk
+ * over every entity. A moving entity's tile is already its destination
+ * (see move()), so the destination is reserved for as long as it moves.
+ *
+ * Kept up to date by update_entity(), see there.
+ */
+static struct
+{
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<uint8_t> first; /*!< First entity+1 on each cell, 0 if none */
+    uint8_t next[MAX_ENTITIES]; /*!< Next entity+1 on the same cell, 0 if none */
+    int cell[MAX_ENTITIES];     /*!< Cell each entity is listed on, -1 if none */
+} occupancy;
+
+/*! \brief One command of a movement script */
+struct s_move_command
+{
+    uint8_t cmd; /*!< One of eCommands, or COMMAND_NONE for an unknown letter */
+    int cmdnum;  /*!< Its parameter; the letter itself for COMMAND_NONE */
+};
+
+/*! \brief A movement script, turned into commands */
+struct s_move_program
+{
+    std::string source;
+    std::vector<s_move_command> commands;
+};
+
+/*! Most compiled scripts to keep around for reuse */
+static const size_t MAX_MOVE_PROGRAMS = 64;
+
+/*! Compiled scripts, most recently used first */
+static std::list<std::shared_ptr<const s_move_program>> move_programs;
+
+/*! The compiled script of each entity; g_ent[].sidx indexes its commands */
+static std::shared_ptr<const s_move_program> programs[MAX_ENTITIES];
+
+/*! Indexes of the active entities, in increasing order */
+static std::vector<t_entity> live_entities;
+
+/*! Whether each entity is in live_entities */
+static bool live[MAX_ENTITIES];
+
+/*! \brief The first entity listed on a cell
+ *
+ * \param   x x-coord
+ * \param   y y-coord
+ * \returns index of entity+1 or 0 if none
+ */
+static int first_occupant(int x, int y)
+{
+    if (!MapGrid.InBounds(x, y) || occupancy.width != MapGrid.Width() || occupancy.height != MapGrid.Height())
+    {
+        return 0;
+    }
+    return occupancy.first[y * occupancy.width + x];
+}
+
 /*! \brief Chase player
  *
  * Chase after the main player #0, if he/she is near.
@@ -135,14 +202,13 @@ static void chase(t_entity target_entity)
  */
 void count_entities(void)
 {
-    size_t entity_index;
-
     number_of_entities = 0;
-    for (entity_index = 0; entity_index < MAX_ENTITIES; entity_index++)
+    for (auto entity_index = live_entities.rbegin(); entity_index != live_entities.rend(); ++entity_index)
     {
-        if (g_ent[entity_index].active == 1)
+        if (g_ent[*entity_index].active == 1)
         {
-            number_of_entities = entity_index + 1;
+            number_of_entities = *entity_index + 1;
+            break;
         }
     }
 }
@@ -198,8 +264,9 @@ int entityat(int ox, int oy, t_entity who)
 {
     t_entity i;
 
-    for (i = 0; i < MAX_ENTITIES; i++)
+    for (int occupant = first_occupant(ox, oy); occupant != 0; occupant = occupancy.next[i])
     {
+        i = occupant - 1;
         if (g_ent[i].active && ox == g_ent[i].tilex && oy == g_ent[i].tiley)
         {
             if (who >= PSIZE)
@@ -209,6 +276,7 @@ int entityat(int ox, int oy, t_entity who)
                     if (Combat.combat(0) == 1)
                     {
                         g_ent[who].active = 0;
+                        update_entity(who);
                     }
                     return 0;
                 }
@@ -221,6 +289,7 @@ int entityat(int ox, int oy, t_entity who)
                     if (Combat.combat(0) == 1)
                     {
                         g_ent[i].active = 0;
+                        update_entity(i);
                     }
                     return 0;
                 }
@@ -349,9 +418,8 @@ static void follow(int tile_x, int tile_y)
     }
 }
 
-/*! \brief Read a command and parameter from a script
+/*! \brief Turn a movement script into commands
  *
- * This processes entity commands from the movement script.
  * This is from Verge1.
  *
  * Script commands are:
@@ -363,89 +431,158 @@ static void follow(int tile_x, int tile_y)
  * - F+param: face direction param (0=S, 1=N, 2=W, 3=E)
  * - K: kill (remove) entity
  *
- * \param   target_entity Entity to process
+ * Any other letter becomes a COMMAND_NONE which does nothing but take a
+ * turn, as it always has.
+ *
+ * \param   source The script
+ * \returns the commands
  */
-static void getcommand(t_entity target_entity)
+static std::shared_ptr<const s_move_program> compile_script(const std::string& source)
 {
-    char s;
+    auto program = std::make_shared<s_move_program>();
+    program->source = source;
 
-    /* PH FIXME: prevented from running off end of string */
-    if (g_ent[target_entity].sidx < sizeof(g_ent[target_entity].script))
+    size_t at = 0;
+    while (at < source.size())
     {
-        s = g_ent[target_entity].script[g_ent[target_entity].sidx++];
+        s_move_command command = { COMMAND_NONE, 0 };
+        bool has_param = true;
+        const char s = source[at++];
+        switch (toupper(static_cast<unsigned char>(s)))
+        {
+        case 'U':
+            command.cmd = COMMAND_MOVE_UP;
+            break;
+        case 'D':
+            command.cmd = COMMAND_MOVE_DOWN;
+            break;
+        case 'L':
+            command.cmd = COMMAND_MOVE_LEFT;
+            break;
+        case 'R':
+            command.cmd = COMMAND_MOVE_RIGHT;
+            break;
+        case 'W':
+            command.cmd = COMMAND_WAIT;
+            break;
+        case 'X':
+            command.cmd = COMMAND_MOVETO_X;
+            break;
+        case 'Y':
+            command.cmd = COMMAND_MOVETO_Y;
+            break;
+        case 'F':
+            command.cmd = COMMAND_FACE;
+            break;
+        case 'B':
+            command.cmd = COMMAND_REPEAT;
+            has_param = false;
+            break;
+        case 'K':
+            command.cmd = COMMAND_KILL;
+            has_param = false;
+            break;
+        default:
+            command.cmdnum = s;
+            has_param = false;
+            break;
+        }
+
+        // 48..57 are '0'..'9' ASCII; more than nine digits would have overflowed the old parser
+        for (int digits = 0; has_param && at < source.size() && source[at] >= 48 && source[at] <= 57; ++at)
+        {
+            if (++digits < 10)
+            {
+                command.cmdnum = command.cmdnum * 10 + (source[at] - '0');
+            }
+        }
+        program->commands.push_back(command);
     }
-    else
+    return program;
+}
+
+/*! \brief Make sure an entity's compiled script matches its script
+ *
+ * Scripts are compiled once and shared; a script used by several entities,
+ * or set again and again by a map's Lua code, is only compiled the first
+ * time (as long as it is among the last MAX_MOVE_PROGRAMS used).
+ *
+ * \param   target_entity Entity to check
+ */
+static void load_program(t_entity target_entity)
+{
+    const char* script = g_ent[target_entity].script;
+    const size_t length = strnlen(script, sizeof(g_ent[target_entity].script));
+    if (programs[target_entity] && programs[target_entity]->source.compare(0, std::string::npos, script, length) == 0)
     {
-        s = '\0';
+        return;
     }
-    switch (s)
+
+    const std::string source(script, length);
+    for (auto it = move_programs.begin(); it != move_programs.end(); ++it)
     {
-    case 'u':
-    case 'U':
-        g_ent[target_entity].cmd = COMMAND_MOVE_UP;
-        parsems(target_entity);
-        break;
-    case 'd':
-    case 'D':
-        g_ent[target_entity].cmd = COMMAND_MOVE_DOWN;
-        parsems(target_entity);
-        break;
-    case 'l':
-    case 'L':
-        g_ent[target_entity].cmd = COMMAND_MOVE_LEFT;
-        parsems(target_entity);
-        break;
-    case 'r':
-    case 'R':
-        g_ent[target_entity].cmd = COMMAND_MOVE_RIGHT;
-        parsems(target_entity);
-        break;
-    case 'w':
-    case 'W':
-        g_ent[target_entity].cmd = COMMAND_WAIT;
-        parsems(target_entity);
-        break;
-    case '\0':
-        g_ent[target_entity].cmd = COMMAND_FINISH_COMMANDS;
-        g_ent[target_entity].movemode = MM_STAND;
-        g_ent[target_entity].cmdnum = 0;
-        g_ent[target_entity].sidx = 0;
-        break;
-    case 'b':
-    case 'B':
-        g_ent[target_entity].cmd = COMMAND_REPEAT;
-        break;
-    case 'x':
-    case 'X':
-        g_ent[target_entity].cmd = COMMAND_MOVETO_X;
-        parsems(target_entity);
-        break;
-    case 'y':
-    case 'Y':
-        g_ent[target_entity].cmd = COMMAND_MOVETO_Y;
-        parsems(target_entity);
-        break;
-    case 'f':
-    case 'F':
-        g_ent[target_entity].cmd = COMMAND_FACE;
-        parsems(target_entity);
+        if ((*it)->source == source)
+        {
+            move_programs.splice(move_programs.begin(), move_programs, it);
+            programs[target_entity] = move_programs.front();
+            return;
+        }
+    }
+
+    move_programs.push_front(compile_script(source));
+    if (move_programs.size() > MAX_MOVE_PROGRAMS)
+    {
+        move_programs.pop_back();
+    }
+    programs[target_entity] = move_programs.front();
+}
+
+/*! \brief Fetch the next command of an entity's script
+ *
+ * This is from Verge1; see compile_script() for the commands.
+ *
+ * \param   target_entity Entity to process
+ */
+static void getcommand(t_entity target_entity)
+{
+    KQEntity& ent = g_ent[target_entity];
+    const s_move_program* program = programs[target_entity].get();
+
+    if (program == nullptr || ent.sidx >= program->commands.size())
+    {
+        ent.cmd = COMMAND_FINISH_COMMANDS;
+        ent.movemode = MM_STAND;
+        ent.cmdnum = 0;
+        ent.sidx = 0;
+        return;
+    }
+
+    const s_move_command& command = program->commands[ent.sidx++];
+    switch (command.cmd)
+    {
+    case COMMAND_REPEAT:
+        ent.cmd = COMMAND_REPEAT;
         break;
-    case 'k':
-    case 'K':
+    case COMMAND_KILL:
         /* PH add: command K makes the ent disappear */
-        g_ent[target_entity].cmd = COMMAND_KILL;
-        g_ent[target_entity].active = 0;
+        ent.cmd = COMMAND_KILL;
+        ent.active = 0;
+        update_entity(target_entity);
         break;
-    default:
+    case COMMAND_NONE:
 #ifdef DEBUGMODE
         if (debugging > 0)
         {
-            sprintf(strbuf, _("Invalid entity command (%c) at position %d for ent %d"), s, g_ent[target_entity].sidx,
+            sprintf(strbuf, _("Invalid entity command (%c) at position %d for ent %d"), command.cmdnum, ent.sidx,
                     target_entity);
             Game.program_death(strbuf);
         }
 #endif
         break;
+    default:
+        ent.cmd = command.cmd;
+        ent.cmdnum = command.cmdnum;
+        break;
     }
 }
 
@@ -459,7 +596,7 @@ static void getcommand(t_entity target_entity)
  */
 static int move(t_entity target_entity, int dx, int dy)
 {
-    int tile_x, tile_y, source_tile, oldfacing;
+    int tile_x, tile_y, oldfacing;
     KQEntity* ent = &g_ent[target_entity];
 
     if (dx == 0 && dy == 0) // Speed optimization.
@@ -546,9 +683,8 @@ static int move(t_entity target_entity, int dx, int dy)
     // Make sure that the player can't avoid special zones by moving diagonally.
     if (dx && dy)
     {
-        source_tile = tile_y * g_map.xsize + tile_x;
-        if (z_seg[source_tile] != z_seg[source_tile + dx] ||
-            z_seg[source_tile] != z_seg[source_tile + dy * g_map.xsize])
+        const uint8_t zone = MapGrid.Cell(tile_x, tile_y).zone;
+        if (zone != MapGrid.Cell(tile_x + dx, tile_y).zone || zone != MapGrid.Cell(tile_x, tile_y + dy).zone)
         {
             if (ent->facing == FACE_LEFT || ent->facing == FACE_RIGHT)
             {
@@ -586,6 +722,7 @@ static int move(t_entity target_entity, int dx, int dy)
 
     ent->tilex = tile_x + dx;
     ent->tiley = tile_y + dy;
+    update_entity(target_entity);
     ent->y += dy;
     ent->x += dx;
     ent->moving = 1;
@@ -623,8 +760,8 @@ static int obstruction(int origin_x, int origin_y, int move_x, int move_y, int c
     dest_y = origin_y + move_y;
 
     // Check the current and target tiles' obstacles
-    current_tile = o_seg[(origin_y * g_map.xsize) + origin_x];
-    target_tile = o_seg[(dest_y * g_map.xsize) + dest_x];
+    current_tile = MapGrid.Cell(origin_x, origin_y).obstacle;
+    target_tile = MapGrid.Cell(dest_x, dest_y).obstacle;
 
     // Return early if the destination tile is an obstruction
     if (target_tile == BLOCK_ALL)
@@ -665,8 +802,9 @@ static int obstruction(int origin_x, int origin_y, int move_x, int move_y, int c
     // Another entity blocks movement as well
     if (check_entity)
     {
-        for (i = 0; i < MAX_ENTITIES; i++)
+        for (int occupant = first_occupant(dest_x, dest_y); occupant != 0; occupant = occupancy.next[i])
         {
+            i = occupant - 1;
             if (g_ent[i].active && dest_x == g_ent[i].tilex && dest_y == g_ent[i].tiley)
             {
                 return 1;
@@ -678,34 +816,6 @@ static int obstruction(int origin_x, int origin_y, int move_x, int move_y, int c
     return 0;
 }
 
-/*! \brief Read an int from a script
- *
- * This parses the movement script for a value that relates
- * to a command.  This is from Verge1.
- *
- * \param   target_entity Entity to process
- */
-static void parsems(t_entity target_entity)
-{
-    uint32_t p = 0;
-    char tok[10];
-    char s;
-
-    s = g_ent[target_entity].script[g_ent[target_entity].sidx];
-
-    // 48..57 are '0'..'9' ASCII
-    while (s >= 48 && s <= 57)
-    {
-        tok[p] = s;
-        p++;
-
-        g_ent[target_entity].sidx++;
-        s = g_ent[target_entity].script[g_ent[target_entity].sidx];
-    }
-    tok[p] = 0;
-    g_ent[target_entity].cmdnum = atoi(tok);
-}
-
 /*! \brief Set position
  *
  * Position an entity manually.
@@ -720,6 +830,7 @@ void place_ent(t_entity en, int ex, int ey)
     g_ent[en].tiley = ey;
     g_ent[en].x = g_ent[en].tilex * TILE_W;
     g_ent[en].y = g_ent[en].tiley * TILE_H;
+    update_entity(en);
 }
 
 /*! \brief Process movement for player
@@ -765,23 +876,22 @@ static void player_move(void)
  */
 void process_entities(void)
 {
-    t_entity i;
-    const char* t_evt;
+    t_entity ready[MAX_ENTITIES];
+    size_t count;
 
-    for (i = 0; i < MAX_ENTITIES; i++)
+    // Entities may be removed while moving, so work from a copy of the list
+    count = live_entities.size();
+    std::copy(live_entities.begin(), live_entities.end(), ready);
+    for (size_t i = 0; i < count; i++)
     {
-        if (g_ent[i].active == 1)
+        if (g_ent[ready[i]].active == 1)
         {
-            speed_adjust(i);
+            speed_adjust(ready[i]);
         }
     }
 
     /* Do timers */
-    t_evt = Game.get_timer_event();
-    if (t_evt)
-    {
-        do_timefunc(t_evt);
-    }
+    run_timers();
 }
 
 /*! \brief Actions for one entity
@@ -918,7 +1028,115 @@ void set_script(t_entity target_entity, const char* movestring)
     g_ent[target_entity].sidx = 0;             // Reset script command index
     g_ent[target_entity].cmdnum = 0;           // There are no scripted commands
     g_ent[target_entity].movemode = MM_SCRIPT; // Force the entity to follow the script
-    strncpy(g_ent[target_entity].script, movestring, sizeof(g_ent[target_entity].script));
+    strncpy(g_ent[target_entity].script, movestring ? movestring : "", sizeof(g_ent[target_entity].script) - 1);
+    g_ent[target_entity].script[sizeof(g_ent[target_entity].script) - 1] = '\0';
+    load_program(target_entity);
+}
+
+/*! \brief Bring an entity's place in the active list and occupancy lists up to date
+ *
+ * Call this after changing an entity's tile or whether it is active;
+ * after changing several entities at once, sync_entities() does them all.
+ *
+ * \param   who Index of entity
+ */
+void update_entity(t_entity who)
+{
+    if (who >= MAX_ENTITIES)
+    {
+        return;
+    }
+    if (occupancy.width != MapGrid.Width() || occupancy.height != MapGrid.Height())
+    {
+        sync_entities();
+        return;
+    }
+
+    const KQEntity& ent = g_ent[who];
+    if (live[who] != (ent.active != 0))
+    {
+        live[who] = ent.active != 0;
+        auto at = std::lower_bound(live_entities.begin(), live_entities.end(), who);
+        if (live[who])
+        {
+            live_entities.insert(at, who);
+        }
+        else
+        {
+            live_entities.erase(at);
+        }
+    }
+
+    const int cell = ent.active && MapGrid.InBounds(ent.tilex, ent.tiley) ? ent.tiley * occupancy.width + ent.tilex : -1;
+    if (cell == occupancy.cell[who])
+    {
+        return;
+    }
+
+    // Unlink from the old cell
+    if (occupancy.cell[who] >= 0)
+    {
+        uint8_t* link = &occupancy.first[occupancy.cell[who]];
+        while (*link != 0 && *link != who + 1)
+        {
+            link = &occupancy.next[*link - 1];
+        }
+        if (*link != 0)
+        {
+            *link = occupancy.next[who];
+        }
+    }
+    occupancy.next[who] = 0;
+    occupancy.cell[who] = cell;
+
+    // Link into the new one, keeping the list in index order
+    if (cell >= 0)
+    {
+        uint8_t* link = &occupancy.first[cell];
+        while (*link != 0 && *link < who + 1)
+        {
+            link = &occupancy.next[*link - 1];
+        }
+        occupancy.next[who] = *link;
+        *link = who + 1;
+    }
+}
+
+/*! \brief Check the active list and occupancy lists against every entity
+ *
+ * Call this after copying entities around in g_ent[] or loading new ones.
+ * Starts the occupancy lists again from scratch if the map has changed size.
+ */
+void sync_entities(void)
+{
+    if (occupancy.width != MapGrid.Width() || occupancy.height != MapGrid.Height())
+    {
+        occupancy.width = MapGrid.Width();
+        occupancy.height = MapGrid.Height();
+        occupancy.first.assign(occupancy.width * occupancy.height, 0);
+        for (t_entity i = 0; i < MAX_ENTITIES; i++)
+        {
+            occupancy.next[i] = 0;
+            occupancy.cell[i] = -1;
+        }
+    }
+    for (t_entity i = 0; i < MAX_ENTITIES; i++)
+    {
+        update_entity(i);
+        load_program(i);
+    }
+}
+
+/*! \brief The active entities
+ *
+ * Loops over the entities on the map should use this rather than look at
+ * all MAX_ENTITIES.
+ *
+ * \returns indexes of the active entities, in increasing order
+ */
+const std::vector<t_entity>& active_entities(void)
+{
+    return live_entities;
 }
 
 /*! \brief Adjust movement speed
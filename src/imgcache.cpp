@@ -25,6 +25,7 @@ the Free Software Foundation,
 #include "res.h"
 #include <map>
 #include <memory>
+#include <mutex>
 #include <png.h>
 #include <string>
 using std::string;
@@ -35,10 +36,13 @@ class image_cache
 {
   public:
     Raster* get(const string& name);
+    Raster* find(const string& name);
     void clear();
 
   private:
     std::map<string, BITMAP_PTR> cache;
+    // Startup slices several images in parallel, so lookups must be guarded
+    std::mutex lock;
 };
 // At the moment there is one global cache;
 // in the future multiple caches could be created
@@ -176,34 +180,52 @@ static Raster* bmp_from_png(const string& path)
  */
 Raster* image_cache::get(const std::string& name)
 {
-    auto entry = cache.find(name);
-    if (entry == cache.end())
+    Raster* bmp = find(name);
+    if (!bmp)
     {
-        // Not found, try to load
-        Raster* bmp = bmp_from_png(kqres(DATA_DIR, name));
-        if (!bmp)
-        {
-            // Try also in maps because it may be a tileset graphic
-            bmp = bmp_from_png(kqres(MAP_DIR, name));
-        }
-        if (!bmp)
+        TRACE("Cannot load bitmap '%s'\n", name.c_str());
+        Game.program_death("Error loading image.");
+    }
+    return bmp;
+}
+/*! \brief Get or load an image, if it exists.
+ * As get() but a missing image is not fatal.
+ * \param name the file base name
+ * \returns the bitmap or NULL
+ */
+Raster* image_cache::find(const std::string& name)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto entry = cache.find(name);
+        if (entry != cache.end())
         {
-            TRACE("Cannot load bitmap '%s'\n", name.c_str());
-            Game.program_death("Error loading image.");
+            return entry->second.get();
         }
-        cache.insert(std::make_pair(name, BITMAP_PTR(bmp)));
-        return bmp;
     }
-    else
+    // Not found, try to load. Decoding is done outside the lock so that
+    // different images can be loaded at the same time.
+    Raster* bmp = bmp_from_png(kqres(DATA_DIR, name));
+    if (!bmp)
     {
-        return entry->second.get();
+        // Try also in maps because it may be a tileset graphic
+        bmp = bmp_from_png(kqres(MAP_DIR, name));
     }
+    if (!bmp)
+    {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    // If another thread loaded the same image meanwhile, keep the first one
+    auto result = cache.insert(std::make_pair(name, BITMAP_PTR(bmp)));
+    return result.first->second.get();
 }
 /*! \brief clear the image cache.
  * Remove all entries, delete the corresponding bitmaps
  */
 void image_cache::clear()
 {
+    std::lock_guard<std::mutex> guard(lock);
     cache.clear();
 }
 /*! \brief get image from the global cache
@@ -214,6 +236,14 @@ Raster* get_cached_image(const std::string& name)
 {
     return global.get(name);
 }
+/*! \brief get image from the global cache, if it can be loaded
+ * \param name the name of the image file
+ * \returns a bitmap or NULL
+ */
+Raster* find_cached_image(const std::string& name)
+{
+    return global.find(name);
+}
 /*! \brief clear the global cache.
  */
 void clear_image_cache()
@@ -54,6 +54,7 @@ extern "C" {
 #include "itemdefs.h"
 #include "itemmenu.h"
 #include "magic.h"
+#include "mapgrid.h"
 #include "masmenu.h"
 #include "menu.h"
 #include "movement.h"
@@ -66,7 +67,13 @@ extern "C" {
 #include "shopmenu.h"
 #include "timing.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <map>
 #include <string>
+#include <vector>
 using std::string;
 #include <memory>
 using std::make_shared;
@@ -74,19 +81,24 @@ using std::shared_ptr;
 
 #include "gfx.h"
 #include "imgcache.h"
+#include "luaprof.h"
 #include "random.h"
+#include "scriptcache.h"
 
 /* Defines */
-#define LUA_ENT_KEY "_ent"
-#define LUA_PLR_KEY "_obj"
+#define LUA_OBJ_META "kq.object"
 
 /* Internal functions */
-static void fieldsort(void);
-static const char* filereader(lua_State* L, void* data, size_t* size);
+static void init_object_meta(lua_State* L);
 static const char* stringreader(lua_State* L, void* data, size_t* size);
 static void init_markers(lua_State* L);
 static void init_obj(lua_State* L);
 int lua_dofile(lua_State*, const char*);
+static void get_script_value(lua_State*, const char*);
+static void resolve_handlers(void);
+static void release_handlers(void);
+static void call_handler(int, int, int);
+static bool start_script(int);
 static int real_entity_num(lua_State*, int);
 
 // void remove_special_item (int index);
@@ -101,12 +113,14 @@ static int KQ_add_timer(lua_State*);
 static int KQ_battle(lua_State*);
 static int KQ_bubble_ex(lua_State*);
 static int KQ_calc_viewport(lua_State*);
+static int KQ_cancel_timer(lua_State*);
 static int KQ_change_map(lua_State*);
 static int KQ_check_key(lua_State*);
 static int KQ_chest(lua_State*);
 static int KQ_clear_buffer(lua_State*);
 static int KQ_combat(lua_State*);
 static int KQ_copy_ent(lua_State*);
+static int KQ_copy_region(lua_State*);
 static int KQ_copy_tile_all(lua_State*);
 static int KQ_create_special_item(lua_State*);
 static int KQ_dark_mbox(lua_State*);
@@ -120,6 +134,7 @@ static int KQ_drawframe(lua_State*);
 static int KQ_drawmap(lua_State*);
 static int KQ_drawsprite(lua_State*);
 static int KQ_face_each_other(lua_State*);
+static int KQ_fill_region(lua_State*);
 static int KQ_gameover_ex(lua_State*);
 static int KQ_get_alldead(lua_State*);
 static int KQ_get_autoparty(lua_State*);
@@ -134,6 +149,7 @@ static int KQ_get_ent_movemode(lua_State*);
 static int KQ_get_ent_obsmode(lua_State*);
 static int KQ_get_ent_snapback(lua_State*);
 static int KQ_get_ent_speed(lua_State*);
+static int KQ_get_ent_states(lua_State*);
 static int KQ_get_ent_tile(lua_State*);
 static int KQ_get_ent_tilex(lua_State*);
 static int KQ_get_ent_tiley(lua_State*);
@@ -178,6 +194,7 @@ static int KQ_move_entity(lua_State*);
 static int KQ_make_sprite(lua_State*);
 static int KQ_msg(lua_State*);
 static int KQ_orient_heroes(lua_State*);
+static int KQ_paste_region(lua_State*);
 static int KQ_pause_song(lua_State*);
 static int KQ_place_ent(lua_State*);
 static int KQ_play_map_song(lua_State*);
@@ -186,6 +203,7 @@ static int KQ_pnum(lua_State*);
 static int KQ_portbubble_ex(lua_State*);
 static int KQ_portthought_ex(lua_State*);
 static int KQ_print(lua_State*);
+static int KQ_profile(lua_State*);
 static int KQ_prompt(lua_State*);
 static int KQ_ptext(lua_State*);
 static int KQ_read_controls(lua_State*);
@@ -212,6 +230,7 @@ static int KQ_set_ent_obsmode(lua_State*);
 static int KQ_set_ent_script(lua_State*);
 static int KQ_set_ent_snapback(lua_State*);
 static int KQ_set_ent_speed(lua_State*);
+static int KQ_set_ent_states(lua_State*);
 static int KQ_set_ent_target(lua_State*);
 static int KQ_set_ent_tilex(lua_State*);
 static int KQ_set_ent_tiley(lua_State*);
@@ -268,9 +287,7 @@ static int KQ_char_setter(lua_State* L);
 static int KQ_check_map_change(void);
 static int KQ_party_getter(lua_State* L);
 static int KQ_party_setter(lua_State* L);
-#ifdef DEBUGMODE
 static int KQ_traceback(lua_State* L);
-#endif
 
 static void set_btile(int, int, int);
 static void set_mtile(int, int, int);
@@ -278,6 +295,8 @@ static void set_ftile(int, int, int);
 static void set_zone(int, int, int);
 static void set_obs(int, int, int);
 static void set_shadow(int, int, int);
+static eMapLayer region_layer(lua_State*, int);
+static void copy_region(int, int, int, int, int, int, unsigned int);
 
 /* The 'luaL_Reg' struct is defined as:
  * struct luaL_Reg
@@ -295,12 +314,14 @@ static const struct luaL_Reg lrs[] = {
     { "battle", KQ_battle },
     { "bubble_ex", KQ_bubble_ex },
     { "calc_viewport", KQ_calc_viewport },
+    { "cancel_timer", KQ_cancel_timer },
     { "change_map", KQ_change_map },
     { "check_key", KQ_check_key },
     { "chest", KQ_chest },
     { "clear_buffer", KQ_clear_buffer },
     { "combat", KQ_combat },
     { "copy_ent", KQ_copy_ent },
+    { "copy_region", KQ_copy_region },
     { "copy_tile_all", KQ_copy_tile_all },
     { "create_special_item", KQ_create_special_item },
     { "dark_mbox", KQ_dark_mbox },
@@ -314,6 +335,7 @@ static const struct luaL_Reg lrs[] = {
     { "drawmap", KQ_drawmap },
     { "drawsprite", KQ_drawsprite },
     { "face_each_other", KQ_face_each_other },
+    { "fill_region", KQ_fill_region },
     { "gameover_ex", KQ_gameover_ex },
     { "get_alldead", KQ_get_alldead },
     { "get_autoparty", KQ_get_autoparty },
@@ -328,6 +350,7 @@ static const struct luaL_Reg lrs[] = {
     { "get_ent_obsmode", KQ_get_ent_obsmode },
     { "get_ent_snapback", KQ_get_ent_snapback },
     { "get_ent_speed", KQ_get_ent_speed },
+    { "get_ent_states", KQ_get_ent_states },
     { "get_ent_tile", KQ_get_ent_tile },
     { "get_ent_tilex", KQ_get_ent_tilex },
     { "get_ent_tiley", KQ_get_ent_tiley },
@@ -372,6 +395,7 @@ static const struct luaL_Reg lrs[] = {
     { "move_entity", KQ_move_entity },
     { "msg", KQ_msg },
     { "orient_heroes", KQ_orient_heroes },
+    { "paste_region", KQ_paste_region },
     { "pause_song", KQ_pause_song },
     { "place_ent", KQ_place_ent },
     { "play_map_song", KQ_play_map_song },
@@ -380,6 +404,7 @@ static const struct luaL_Reg lrs[] = {
     { "portbubble_ex", KQ_portbubble_ex },
     { "portthought_ex", KQ_portthought_ex },
     { "print", KQ_print },
+    { "profile", KQ_profile },
     { "prompt", KQ_prompt },
     { "ptext", KQ_ptext },
     { "read_controls", KQ_read_controls },
@@ -406,6 +431,7 @@ static const struct luaL_Reg lrs[] = {
     { "set_ent_script", KQ_set_ent_script },
     { "set_ent_snapback", KQ_set_ent_snapback },
     { "set_ent_speed", KQ_set_ent_speed },
+    { "set_ent_states", KQ_set_ent_states },
     { "set_ent_target", KQ_set_ent_target },
     { "set_ent_tilex", KQ_set_ent_tilex },
     { "set_ent_tiley", KQ_set_ent_tiley },
@@ -460,35 +486,57 @@ static const struct luaL_Reg lrs[] = {
     { NULL, NULL } /* Must always be the LAST entry */
 };
 
-/*! \brief Maps a text field name to an identifier */
-static struct s_field
-{
-    const char* name;
-    int id;
-} // no semi-colon!!
-
-// *INDENT-OFF*
-fields[] = {
-    { "name", 0 },    // Name of entity
-    { "xp", 1 },      // Entity experience
-    { "next", 2 },    // Experience left for next level-up
-    { "lvl", 3 },     // Current level of entity
-    { "mrp", 4 },     // Magic actually required for a spell (can be reduced with I_MANALOCKET)
-    { "hp", 5 },      // Entity's current hit points
-    { "mhp", 6 },     // Maximum hit points
-    { "mp", 7 },      // Current magic points
-    { "mmp", 8 },     // Maximum magic points
-    { "id", 9 },      // Index # of entity, which determines look and skills
-    { "tilex", 10 },  // Position of entity, full x tile
-    { "tiley", 11 },  // Position of entity, full y tile
-    { "eid", 12 },    // Entity ID
-    { "chrx", 13 },   // Appearance of entity
-    { "facing", 14 }, // Direction facing
-    { "active", 15 }, // Active or not
-    { "say", 16 },    // Text bubble
-    { "think", 17 },  // Thought bubble
+/*! \brief Properties of hero and entity objects */
+enum eObjectField
+{
+    FIELD_NAME = 0, // Name of entity
+    FIELD_XP,       // Entity experience
+    FIELD_NEXT,     // Experience left for next level-up
+    FIELD_LVL,      // Current level of entity
+    FIELD_MRP,      // Magic actually required for a spell (can be reduced with I_MANALOCKET)
+    FIELD_HP,       // Entity's current hit points
+    FIELD_MHP,      // Maximum hit points
+    FIELD_MP,       // Current magic points
+    FIELD_MMP,      // Maximum magic points
+    FIELD_ID,       // Index # of entity, which determines look and skills
+    FIELD_TILEX,    // Position of entity, full x tile
+    FIELD_TILEY,    // Position of entity, full y tile
+    FIELD_EID,      // Entity ID
+    FIELD_CHRX,     // Appearance of entity
+    FIELD_FACING,   // Direction facing
+    FIELD_ACTIVE,   // Active or not
+    FIELD_SAY,      // Text bubble
+    FIELD_THINK,    // Thought bubble
+
+    NUM_FIELDS
+};
+
+/*! Names of the eObjectField properties as seen from Lua */
+static const char* const field_names[NUM_FIELDS] = {
+    "name", "xp",    "next",  "lvl", "mrp",  "hp",     "mhp",    "mp",  "mmp",
+    "id",   "tilex", "tiley", "eid", "chrx", "facing", "active", "say", "think",
+};
+
+/* The entity fields in the tables used by get_ent_states() and set_ent_states() */
+enum eStateField
+{
+    STATE_TILEX = 0,
+    STATE_TILEY,
+    STATE_FACING,
+    STATE_MOVEMODE,
+    STATE_ACTIVE,
+
+    NUM_STATE_FIELDS
+};
+
+static const char* const state_names[NUM_STATE_FIELDS] = { "tilex", "tiley", "facing", "movemode", "active" };
+
+/*! \brief The full userdata behind a hero or entity object */
+struct s_lua_object
+{
+    KPlayer* player;  /*!< The hero, or NULL for an NPC */
+    KQEntity* entity; /*!< Entity on the map, or NULL for a hero who isn't in the party */
 };
-// *INDENT-ON*
 
 /*
  * PH's own notes:
@@ -507,6 +555,115 @@ static int g_keys[8];
 static int tmx, tmy, tmvx, tmvy;
 static lua_State* theL;
 
+/* Registry reference to the current map script's environment, or LUA_NOREF.
+ * The map script runs with this as its _ENV, so whatever it defines is
+ * thrown away with the map, while anything it does not define is looked up
+ * in the globals, which last as long as the VM.
+ */
+static int map_env = LUA_NOREF;
+
+/* Whether global.lua has been run in this VM yet */
+static bool global_loaded = false;
+
+/* Name of the map script loaded by do_luainit() */
+static string script_name;
+
+/* The functions a map script can define for the engine to call */
+enum eScriptHandler
+{
+    HANDLER_AUTOEXEC = 0,
+    HANDLER_POSTEXEC,
+    HANDLER_ENTITY,
+    HANDLER_ZONE,
+
+    NUM_HANDLERS
+};
+
+static const char* const handler_names[NUM_HANDLERS] = { "autoexec", "postexec", "entity_handler", "zone_handler" };
+
+/* Registry references to the current map's handlers, looked up once when
+ * the map's script is loaded. LUA_NOREF if the map doesn't define one.
+ */
+static int handlers[NUM_HANDLERS] = { LUA_NOREF, LUA_NOREF, LUA_NOREF, LUA_NOREF };
+
+/* Registry reference to KQ_traceback, the message handler for handlers */
+static int traceback_ref = LUA_NOREF;
+
+/* The garbage collector is stopped and stepped by collect_script_garbage()
+ * in the time each frame would otherwise sleep through. Steps are sized to
+ * take about GC_STEP_US; after finishing a cycle it rests until memory has
+ * grown by half again, as the collector itself would.
+ */
+static const int GC_MIN_STEP_KB = 4;
+static const int GC_MAX_STEP_KB = 1024;
+static const long GC_STEP_US = 1000;
+static int gc_step_kb = GC_MIN_STEP_KB;
+static int gc_cycle_kb = 0; /* memory in use when the last cycle finished */
+static bool gc_resting = false;
+
+/* A function set up by add_timer() */
+struct s_timer
+{
+    int func;     /* registry reference to the function */
+    int args;     /* registry reference to a table of its arguments, or LUA_NOREF */
+    int nargs;    /* number of arguments */
+    int interval; /* seconds between calls, or 0 to call it once */
+};
+
+/* When a timer is next due. These are kept in a heap with the soonest on
+ * top; a timer which is cancelled leaves its entry behind, to be skipped
+ * when it comes to the top.
+ */
+struct s_timer_due
+{
+    int when;           /* ksec when it is due */
+    unsigned int order; /* timers due at the same time run in the order they were set */
+    int id;             /* key in timers */
+};
+
+/* Pending timers, by the handle add_timer() returned */
+static std::map<int, s_timer> timers;
+
+static std::vector<s_timer_due> timer_heap;
+static int last_timer_id = 0;
+static unsigned int timer_order = 0;
+
+/* What a suspended script thread is waiting for */
+enum eScriptWait
+{
+    WAIT_TICKS = 0, /* a number of game ticks: wait() */
+    WAIT_ENTITIES,  /* a range of entities to finish moving: wait_for_entity() */
+    WAIT_ENTER      /* the ALT key: wait_enter() */
+};
+
+struct s_script_wait
+{
+    eScriptWait type;
+    int ticks;    /* WAIT_TICKS: ticks still to go */
+    size_t first; /* WAIT_ENTITIES: first and last entity */
+    size_t last;
+};
+
+/* A handler running as a Lua thread, suspended in one of the waits */
+struct s_script_thread
+{
+    lua_State* thread;
+    int ref; /* registry reference which keeps the thread alive */
+    s_script_wait wait;
+};
+
+/* Script threads waiting to be resumed by run_scripts() */
+static std::list<s_script_thread> script_threads;
+
+/* The script thread being run, if any; only this one may yield */
+static lua_State* running_script = NULL;
+
+/* Set by a waiting function just before it yields */
+static s_script_wait pending_wait;
+
+/* Bumped whenever the script threads are thrown away */
+static unsigned int script_generation = 0;
+
 /* These variables handle the map->map transition. */
 static char tmap_name[16];
 static char marker_name[255];
@@ -550,17 +707,7 @@ static int KQ_check_map_change(void)
  */
 void do_autoexec(void)
 {
-    int oldtop = lua_gettop(theL);
-
-#ifdef DEBUGMODE
-    lua_pushcfunction(theL, KQ_traceback);
-    lua_getglobal(theL, "autoexec");
-    lua_pcall(theL, 0, 0, oldtop + 1);
-#else
-    lua_getglobal(theL, "autoexec");
-    lua_call(theL, 0, 0);
-#endif
-    lua_settop(theL, oldtop);
+    call_handler(handlers[HANDLER_AUTOEXEC], 0, 0);
     KQ_check_map_change();
 }
 
@@ -573,20 +720,12 @@ void do_autoexec(void)
  */
 void do_entity(int en_num)
 {
-    int oldtop = lua_gettop(theL);
-
-#ifdef DEBUGMODE
-    lua_pushcfunction(theL, KQ_traceback);
-    lua_getglobal(theL, "entity_handler");
-    lua_pushnumber(theL, en_num - PSIZE);
-    lua_pcall(theL, 1, 0, oldtop + 1);
-#else
-    lua_getglobal(theL, "entity_handler");
+    lua_rawgeti(theL, LUA_REGISTRYINDEX, handlers[HANDLER_ENTITY]);
     lua_pushnumber(theL, en_num - PSIZE);
-    lua_call(theL, 1, 0);
-#endif
-    lua_settop(theL, oldtop);
-    KQ_check_map_change();
+    if (start_script(1))
+    {
+        KQ_check_map_change();
+    }
 }
 
 #ifdef KQ_CHEATS
@@ -612,10 +751,10 @@ void do_luacheat(void)
     }
     oldtop = lua_gettop(theL);
 #ifdef DEBUGMODE
-    lua_pushcfunction(theL, KQ_traceback);
+    lua_rawgeti(theL, LUA_REGISTRYINDEX, traceback_ref);
 #endif
     lua_dofile(theL, cheatfile.c_str());
-    lua_getglobal(theL, "cheat");
+    get_script_value(theL, "cheat");
 #ifdef DEBUGMODE
     lua_pcall(theL, 0, 0, oldtop + 1);
 #else
@@ -627,22 +766,15 @@ void do_luacheat(void)
 }
 #endif
 
-/*! \brief Initialize scripting engine
- *
- * Initialize the Lua scripting engine by loading from a file. A new VM is
- * created each time.
+/*! \brief Create the Lua VM
  *
- * \param   fname Base name of script; xxxxx loads script scripts/xxxxx.lob
- * \param   global non-zero to load global.lob. 0 to not load global.lob
+ * The VM is kept from map to map, so the libraries and the C functions are
+ * only registered once.
  */
-void do_luainit(const char* fname, int global)
+static void open_lua(void)
 {
-    int oldtop;
     const struct luaL_Reg* rg = lrs;
-    if (theL != NULL)
-    {
-        do_luakill();
-    }
+
     /* In Lua 5.1, this is a compatibility #define to luaL_newstate */
     /* In Lua 5.2, this #define doesn't exist anymode. Switching to luaL_newstate */
     theL = luaL_newstate();
@@ -650,204 +782,608 @@ void do_luainit(const char* fname, int global)
     {
         Game.program_death(_("Could not initialize scripting engine"));
     }
+#if LUA_VERSION_NUM >= 504
+    /* Generational mode never finishes a cycle, so collect_script_garbage()
+     * could never rest; make sure the collector is incremental
+     */
+    lua_gc(theL, LUA_GCINC, 0, 0, 0);
+#endif
+    /* Only collect when collect_script_garbage() says so */
+    lua_gc(theL, LUA_GCSTOP, 0);
+    gc_step_kb = GC_MIN_STEP_KB;
+    gc_cycle_kb = lua_gc(theL, LUA_GCCOUNT, 0);
+    gc_resting = false;
     /* This line breaks compatibility with Lua 5.0. Hopefully, we can do a full
      * upgrade later. */
     luaL_openlibs(theL);
-    fieldsort();
+    init_object_meta(theL);
     while (rg->name)
     {
         lua_register(theL, rg->name, rg->func);
         ++rg;
     }
+#ifdef DEBUGMODE
+    lua_pushcfunction(theL, KQ_traceback);
+    traceback_ref = luaL_ref(theL, LUA_REGISTRYINDEX);
+#endif
+    global_loaded = false;
+}
+
+/*! \brief Initialize scripting engine
+ *
+ * Run a map's script. The VM is created the first time and kept after
+ * that, and global.lob is only run once in it. Each map script gets a new
+ * environment of its own, which can see all the globals.
+ *
+ * \param   fname Base name of script; xxxxx loads script scripts/xxxxx.lob
+ * \param   global non-zero to load global.lob. 0 to not load global.lob
+ */
+void do_luainit(const char* fname, int global)
+{
+    int oldtop;
+
+    if (theL == NULL)
+    {
+        open_lua();
+    }
+    do_luakill();
+
+    /* The hero, entity and marker objects are rebuilt for each map */
     init_obj(theL);
     init_markers(theL);
+    script_name = fname;
     oldtop = lua_gettop(theL);
-    if (global)
+    if (global && !global_loaded)
     {
         if (lua_dofile(theL, kqres(SCRIPT_DIR, "global").c_str()) != 0)
         {
             /* lua_dofile already displayed error message */
             Game.program_death(strbuf);
         }
+        global_loaded = true;
     }
 
+    /* The map's environment: anything it lacks is looked up in the globals */
+    lua_newtable(theL);
+    lua_createtable(theL, 0, 1);
+    lua_pushglobaltable(theL);
+    lua_setfield(theL, -2, "__index");
+    lua_setmetatable(theL, -2);
+    map_env = luaL_ref(theL, LUA_REGISTRYINDEX);
+
     if (lua_dofile(theL, kqres(SCRIPT_DIR, fname).c_str()) != 0)
     {
         /* lua_dofile already displayed error message */
         Game.program_death(strbuf);
     }
     lua_settop(theL, oldtop);
+    resolve_handlers();
     changing_map = NOT_CHANGING;
 }
 
-/*! \brief Kill the lua VM
+/*! \brief Unload the map's script
+ *
+ * Drop the current map script's environment, timers and any script threads
+ * still waiting. The VM, and the globals in it, are kept for the next map.
+ * If the profiler is on, its report for the map is written out.
  *
- * Close the Lua virtual machine.
+ * Changing maps is a pause anyway, so everything the old map used is
+ * collected here in one go.
  */
 void do_luakill(void)
 {
-    Game.reset_timer_events();
+    LuaProfiler.Report(script_name);
+    reset_timers();
+    release_handlers();
+    /* Scripts still waiting belong to the map being left */
+    if (!script_threads.empty())
+    {
+        for (auto& script : script_threads)
+        {
+            luaL_unref(theL, LUA_REGISTRYINDEX, script.ref);
+        }
+        script_threads.clear();
+        autoparty = 0;
+    }
+    ++script_generation;
+    if (theL && map_env != LUA_NOREF)
+    {
+        luaL_unref(theL, LUA_REGISTRYINDEX, map_env);
+    }
+    map_env = LUA_NOREF;
     if (theL)
     {
+        lua_gc(theL, LUA_GCCOLLECT, 0);
+        gc_cycle_kb = lua_gc(theL, LUA_GCCOUNT, 0);
+        gc_resting = true;
+    }
+}
+
+/*! \brief Close the Lua VM
+ *
+ * Throw away everything in it, globals included.
+ */
+static void close_lua(void)
+{
+    do_luakill();
+    if (theL)
+    {
+        LuaProfiler.Stop(theL);
         lua_close(theL);
         theL = NULL;
     }
+    traceback_ref = LUA_NOREF;
 }
 
-/*! \brief Run initial graphical code
+/*! \brief Finish with a script thread
  *
- * This function is called after the map is faded back in.  It's possible to
- * show speech, move entities, etc. here.
+ * \param   script The thread
+ * \param   status What lua_resume() returned
  */
-void do_postexec(void)
+static void end_script(const s_script_thread& script, int status)
 {
-    int oldtop = lua_gettop(theL);
+    if (status != LUA_OK)
+    {
+        TRACE("Error in script thread\n");
+        KQ_traceback(script.thread);
+    }
+    luaL_unref(theL, LUA_REGISTRYINDEX, script.ref);
+}
 
-#ifdef DEBUGMODE
-    lua_pushcfunction(theL, KQ_traceback);
-    lua_getglobal(theL, "postexec");
-    lua_pcall(theL, 0, 0, oldtop + 1);
+/*! \brief Run a script thread until it finishes or waits
+ *
+ * \param   script The thread; its wait is filled in if it yields
+ * \param   nargs Number of arguments on the thread's stack
+ * \returns what lua_resume() returned
+ */
+static int resume_script(s_script_thread& script, int nargs)
+{
+    lua_State* previous = running_script;
+
+    running_script = script.thread;
+#if LUA_VERSION_NUM >= 504
+    int yielded;
+    const int status = lua_resume(script.thread, NULL, nargs, &yielded);
 #else
-    lua_getglobal(theL, "postexec");
-    lua_call(theL, 0, 0);
+    const int status = lua_resume(script.thread, NULL, nargs);
+    const int yielded = status == LUA_YIELD ? lua_gettop(script.thread) : 0;
 #endif
-    lua_settop(theL, oldtop);
-    KQ_check_map_change();
+    running_script = previous;
+    if (status == LUA_YIELD)
+    {
+        /* The waits yield nothing, but don't let anything else pile up */
+        lua_pop(script.thread, yielded);
+        script.wait = pending_wait;
+    }
+    return status;
 }
 
-/*! \brief Get quest info items from script
+/*! \brief Run a function as a new script thread
  *
- * When user opens the Quest menu, the actual quest data is imported from Lua.
- * The get_quest_info() function returns its quests via a callback to add_quest_item().
+ * The function and its arguments are on top of the stack, and are taken
+ * off. It runs straight away, until it finishes or calls one of the
+ * waiting functions; in that case run_scripts() carries on with it later.
+ * Anything which isn't a function is just dropped.
+ *
+ * \param   nargs Number of arguments above the function
+ * \returns true if it has finished, false if it is waiting
  */
-void do_importquests(void)
+static bool start_script(int nargs)
 {
-    int oldtop = lua_gettop(theL);
+    if (!lua_isfunction(theL, -(nargs + 1)))
+    {
+        lua_pop(theL, nargs + 1);
+        return true;
+    }
+    s_script_thread script;
+    script.thread = lua_newthread(theL);
+    lua_insert(theL, -(nargs + 2));
+    lua_xmove(theL, script.thread, nargs + 1);
+    script.ref = luaL_ref(theL, LUA_REGISTRYINDEX);
 
-    lua_getglobal(theL, "get_quest_info");
-    if (!lua_isnil(theL, -1))
+    const int status = resume_script(script, nargs);
+    if (status == LUA_YIELD)
     {
-        lua_call(theL, 0, 0);
+        script_threads.push_back(script);
+        /* The party is under script control until every thread is done */
+        autoparty = 1;
+        return false;
     }
-    lua_settop(theL, oldtop);
+    end_script(script, status);
+    return true;
 }
 
-/*! \brief trigger time events
+/*! \brief Suspend the running script thread
+ *
+ * For the waiting functions, when they are called from a script thread.
  *
- * Call the named function. This is called
- * when an event is triggered.
- * \param funcname the name of the function to call
+ * \param   L The script thread
+ * \param   wait What to wait for
+ * \returns lua_yield()
  */
-void do_timefunc(const char* funcname)
+static int wait_script(lua_State* L, const s_script_wait& wait)
 {
-    int oldtop = lua_gettop(theL);
+    pending_wait = wait;
+    return lua_yield(L, 0);
+}
 
-#ifdef DEBUGMODE
-    lua_pushcfunction(theL, KQ_traceback);
-    lua_getglobal(theL, funcname);
-    if (!lua_isnil(theL, -1))
+void run_scripts(int ticks)
+{
+    const unsigned int generation = script_generation;
+    bool enter = false;
+
+    if (script_threads.empty())
     {
-        lua_pcall(theL, 1, 0, oldtop + 1);
+        return;
     }
-    else
+    for (auto& script : script_threads)
     {
-        lua_pop(theL, 1);
+        if (script.wait.type == WAIT_ENTER)
+        {
+            PlayerInput.readcontrols();
+            enter = PlayerInput.balt;
+            break;
+        }
     }
-#else
-    lua_getglobal(theL, funcname);
-    if (!lua_isnil(theL, -1))
+
+    /* Threads started while this runs wait for the next time round */
+    size_t count = script_threads.size();
+    for (auto it = script_threads.begin(); count > 0; --count)
     {
-        lua_call(theL, 1, 0);
+        bool ready = false;
+        switch (it->wait.type)
+        {
+        case WAIT_TICKS:
+            it->wait.ticks -= ticks;
+            ready = it->wait.ticks <= 0;
+            break;
+
+        case WAIT_ENTITIES:
+            ready = !Game.scripted_movement(it->wait.first, it->wait.last);
+            break;
+
+        case WAIT_ENTER:
+            ready = enter;
+            break;
+        }
+        if (!ready)
+        {
+            ++it;
+            continue;
+        }
+        if (it->wait.type == WAIT_ENTER)
+        {
+            Game.unpress();
+        }
+        const int status = resume_script(*it, 0);
+        if (generation != script_generation)
+        {
+            return;
+        }
+        if (status == LUA_YIELD)
+        {
+            ++it;
+            continue;
+        }
+        end_script(*it, status);
+        it = script_threads.erase(it);
+        KQ_check_map_change();
+        if (generation != script_generation)
+        {
+            return;
+        }
     }
-    else
+    if (script_threads.empty())
     {
-        lua_pop(theL, 1);
+        autoparty = 0;
     }
-#endif
-    lua_settop(theL, oldtop);
-    KQ_check_map_change();
 }
 
-/*! \brief Trigger zone action
+bool scripts_waiting(void)
+{
+    return !script_threads.empty();
+}
+
+void collect_script_garbage(long us)
+{
+    using std::chrono::steady_clock;
+
+    if (theL == NULL)
+    {
+        return;
+    }
+    const int kb = lua_gc(theL, LUA_GCCOUNT, 0);
+    if (gc_resting && kb < gc_cycle_kb + gc_cycle_kb / 2)
+    {
+        return;
+    }
+    gc_resting = false;
+    /* Memory has doubled since the last cycle, so allocation is outrunning
+     * the steps: let them grow even if they take longer than they should
+     */
+    const bool behind = kb > 2 * gc_cycle_kb;
+
+    const auto start = steady_clock::now();
+    long spent = 0;
+    long step = 0;
+    do
+    {
+        const auto before = steady_clock::now();
+        const bool finished = lua_gc(theL, LUA_GCSTEP, gc_step_kb) != 0;
+        const auto after = steady_clock::now();
+        step = std::chrono::duration_cast<std::chrono::microseconds>(after - before).count();
+        spent = std::chrono::duration_cast<std::chrono::microseconds>(after - start).count();
+        if ((behind || step < GC_STEP_US / 2) && gc_step_kb < GC_MAX_STEP_KB)
+        {
+            gc_step_kb *= 2;
+        }
+        else if (!behind && step > GC_STEP_US && gc_step_kb > GC_MIN_STEP_KB)
+        {
+            gc_step_kb /= 2;
+        }
+        if (finished)
+        {
+            gc_cycle_kb = lua_gc(theL, LUA_GCCOUNT, 0);
+            gc_resting = true;
+            break;
+        }
+    } while (spent + step < us);
+}
+
+int script_memory(void)
+{
+    return theL ? lua_gc(theL, LUA_GCCOUNT, 0) : 0;
+}
+
+/*! \brief Push something defined by the map's script
  *
- * Run the Lua function zone_handler(int) to take action based on the zone
- * that the hero has just stepped on.  This function is not called for zone 0,
- * unless the map property zero_zone is non-zero.
+ * Looks in the current map's environment, and through that in the globals.
  *
- * \param   zn_num Zone number
+ * \param   L the Lua state
+ * \param   name Name of the variable
  */
-void do_zone(int zn_num)
+static void get_script_value(lua_State* L, const char* name)
+{
+    if (map_env == LUA_NOREF)
+    {
+        lua_getglobal(L, name);
+        return;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, map_env);
+    lua_getfield(L, -1, name);
+    lua_remove(L, -2);
+}
+
+/*! \brief Look up the current map's handlers
+ *
+ * Done once when the map's script has run, so that calling a handler does
+ * not have to look it up by name. Anything which isn't a function counts as
+ * no handler.
+ */
+static void resolve_handlers(void)
+{
+    release_handlers();
+    for (int i = 0; i < NUM_HANDLERS; ++i)
+    {
+        get_script_value(theL, handler_names[i]);
+        if (lua_isfunction(theL, -1))
+        {
+            handlers[i] = luaL_ref(theL, LUA_REGISTRYINDEX);
+        }
+        else
+        {
+            lua_pop(theL, 1);
+        }
+    }
+}
+
+/*! \brief Forget the current map's handlers */
+static void release_handlers(void)
 {
+    for (int& handler : handlers)
+    {
+        if (theL && handler != LUA_NOREF)
+        {
+            luaL_unref(theL, LUA_REGISTRYINDEX, handler);
+        }
+        handler = LUA_NOREF;
+    }
+}
+
+/*! \brief Call one of the map's handlers
+ *
+ * Does nothing if the map doesn't define it.
+ *
+ * \param   handler Registry reference to the handler, or LUA_NOREF
+ * \param   nargs Number of arguments, 0 or 1
+ * \param   arg The argument, if any
+ */
+static void call_handler(int handler, int nargs, int arg)
+{
+    if (handler == LUA_NOREF)
+    {
+        return;
+    }
     int oldtop = lua_gettop(theL);
 
 #ifdef DEBUGMODE
-    lua_pushcfunction(theL, KQ_traceback);
-    lua_getglobal(theL, "zone_handler");
-    lua_pushnumber(theL, zn_num);
-    lua_pcall(theL, 1, 0, oldtop + 1);
+    lua_rawgeti(theL, LUA_REGISTRYINDEX, traceback_ref);
+#endif
+    lua_rawgeti(theL, LUA_REGISTRYINDEX, handler);
+    if (nargs > 0)
+    {
+        lua_pushnumber(theL, arg);
+    }
+#ifdef DEBUGMODE
+    lua_pcall(theL, nargs, 0, oldtop + 1);
 #else
-    lua_getglobal(theL, "zone_handler");
-    lua_pushnumber(theL, zn_num);
-    lua_call(theL, 1, 0);
+    lua_call(theL, nargs, 0);
 #endif
     lua_settop(theL, oldtop);
-    KQ_check_map_change();
 }
 
-/*! \brief Initialize world specific variables
+/*! \brief Run a loaded chunk in the map's environment
  *
- * This function is called on a new game, or when loading a game.
- * It calls lua_user_init in init.lua. Generally, this will set the names,
- * items, etc of all shops in the game, and the special items, and other
- * world-specific stuff. It does not have any arguments, or
- * return any values.
+ * The chunk on top of the stack is given the current map's environment as
+ * its _ENV. If no map script is loaded, it keeps the globals.
+ *
+ * \param   L the Lua state
  */
-void lua_user_init(void)
+static void use_map_env(lua_State* L)
 {
-    do_luakill();
-    do_luainit("init", 1);
-    lua_getglobal(theL, "lua_user_init");
-    lua_call(theL, 0, 0);
+    if (map_env == LUA_NOREF)
+    {
+        return;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, map_env);
+    /* A main chunk's only upvalue is its _ENV */
+    if (lua_setupvalue(L, -2, 1) == NULL)
+    {
+        lua_pop(L, 1);
+    }
 }
 
-static int fieldcmp(const void* pa, const void* pb)
+/*! \brief Run initial graphical code
+ *
+ * This function is called after the map is faded back in.  It's possible to
+ * show speech, move entities, etc. here. It runs as a script thread, so it
+ * can wait() without holding up the game loop.
+ */
+void do_postexec(void)
 {
-    const struct s_field* a = (const struct s_field*)pa;
-    const struct s_field* b = (const struct s_field*)pb;
-
-    return (strcmp(a->name, b->name));
+    lua_rawgeti(theL, LUA_REGISTRYINDEX, handlers[HANDLER_POSTEXEC]);
+    if (start_script(0))
+    {
+        KQ_check_map_change();
+    }
 }
 
-/*! \brief Sort field array
+/*! \brief Get quest info items from script
  *
- * This uses qsort to sort the fields, ready for bsearch to search them
- * \author PH
- * \date Created 20030407
+ * When user opens the Quest menu, the actual quest data is imported from Lua.
+ * The get_quest_info() function returns its quests via a callback to add_quest_item().
  */
-static void fieldsort(void)
+void do_importquests(void)
 {
-    qsort(fields, sizeof(fields) / sizeof(*fields), sizeof(struct s_field), fieldcmp);
+    int oldtop = lua_gettop(theL);
+
+    get_script_value(theL, "get_quest_info");
+    if (!lua_isnil(theL, -1))
+    {
+        lua_call(theL, 0, 0);
+    }
+    lua_settop(theL, oldtop);
 }
 
-struct readerbuf_t
+/*! \brief Heap order for s_timer_due: true if a is due after b */
+static bool due_after(const s_timer_due& a, const s_timer_due& b)
 {
-    FILE* in;
-    char buffer[1024];
-};
+    return a.when != b.when ? a.when > b.when : a.order > b.order;
+}
+
+/*! \brief Put a timer into the heap */
+static void schedule_timer(int id, int when)
+{
+    timer_heap.push_back({ when, timer_order++, id });
+    std::push_heap(timer_heap.begin(), timer_heap.end(), due_after);
+}
+
+/*! \brief Drop a timer's references to its function and arguments */
+static void release_timer(const s_timer& timer)
+{
+    luaL_unref(theL, LUA_REGISTRYINDEX, timer.func);
+    luaL_unref(theL, LUA_REGISTRYINDEX, timer.args);
+}
+
+void run_timers(void)
+{
+    while (!timer_heap.empty() && timer_heap.front().when <= ksec)
+    {
+        const s_timer_due due = timer_heap.front();
+        std::pop_heap(timer_heap.begin(), timer_heap.end(), due_after);
+        timer_heap.pop_back();
+        auto found = timers.find(due.id);
+        if (found == timers.end())
+        {
+            /* Cancelled */
+            continue;
+        }
+
+        const s_timer timer = found->second;
+        lua_rawgeti(theL, LUA_REGISTRYINDEX, timer.func);
+        if (timer.nargs > 0)
+        {
+            lua_rawgeti(theL, LUA_REGISTRYINDEX, timer.args);
+            for (int i = 1; i <= timer.nargs; ++i)
+            {
+                lua_rawgeti(theL, -i, i);
+            }
+            lua_remove(theL, -timer.nargs - 1);
+        }
+        if (timer.interval > 0)
+        {
+            /* If the game has fallen behind, don't try to catch up */
+            schedule_timer(due.id, std::max(due.when + timer.interval, ksec + 1));
+        }
+        else
+        {
+            release_timer(timer);
+            timers.erase(found);
+        }
+        if (start_script(timer.nargs))
+        {
+            KQ_check_map_change();
+        }
+        return;
+    }
+}
 
-/*! \brief Read file chunk
+void reset_timers(void)
+{
+    if (theL)
+    {
+        for (auto& timer : timers)
+        {
+            release_timer(timer.second);
+        }
+    }
+    timers.clear();
+    timer_heap.clear();
+}
+
+/*! \brief Trigger zone action
  *
- * Read in a piece of a file for the Lua system to compile
+ * Run the Lua function zone_handler(int) to take action based on the zone
+ * that the hero has just stepped on.  This function is not called for zone 0,
+ * unless the map property zero_zone is non-zero.
  *
- * \param L the Lua state (ignored)
- * \param data a pointer to a readerbuf_t structure
- * \param size [out] the number of bytes read
+ * \param   zn_num Zone number
+ */
+void do_zone(int zn_num)
+{
+    lua_rawgeti(theL, LUA_REGISTRYINDEX, handlers[HANDLER_ZONE]);
+    lua_pushnumber(theL, zn_num);
+    if (start_script(1))
+    {
+        KQ_check_map_change();
+    }
+}
+
+/*! \brief Initialize world specific variables
+ *
+ * This function is called on a new game, or when loading a game.
+ * It calls lua_user_init in init.lua. Generally, this will set the names,
+ * items, etc of all shops in the game, and the special items, and other
+ * world-specific stuff. It does not have any arguments, or
+ * return any values.
  */
-static const char* filereader(lua_State*, void* data, size_t* size)
+void lua_user_init(void)
 {
-    auto r = reinterpret_cast<readerbuf_t*>(data);
-    *size = fread(r->buffer, sizeof(char), sizeof(r->buffer), r->in);
-    return r->buffer;
+    /* A new or loaded game starts from a fresh VM */
+    close_lua();
+    do_luainit("init", 1);
+    get_script_value(theL, "lua_user_init");
+    lua_call(theL, 0, 0);
 }
 
 /*! \brief Read string chunk
@@ -914,21 +1450,75 @@ static shared_ptr<KMarker> KQ_find_marker(string name, int required)
     return nullptr;
 }
 
-/*! \brief Get the field number from a name.
+/*! \brief Set up the metatable shared by all hero and entity objects
+ *
+ * The field names are turned into numbers once, in a table which both
+ * metamethods get as their first upvalue; looking a name up there is a
+ * plain table access on an already interned string.
+ *
+ * \param   L the Lua state
+ */
+static void init_object_meta(lua_State* L)
+{
+    luaL_newmetatable(L, LUA_OBJ_META);
+    lua_createtable(L, 0, NUM_FIELDS);
+    for (int i = 0; i < NUM_FIELDS; ++i)
+    {
+        lua_pushinteger(L, i);
+        lua_setfield(L, -2, field_names[i]);
+    }
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, KQ_char_getter, 1);
+    lua_setfield(L, -3, "__index");
+    lua_pushcclosure(L, KQ_char_setter, 1);
+    lua_setfield(L, -2, "__newindex");
+    lua_pop(L, 1);
+}
+
+/*! \brief Make a new hero or entity object
+ *
+ * Leaves it on the stack. Each object has a table of its own as its user
+ * value, which holds any properties that scripts add.
+ *
+ * \param   L the Lua state
+ * \param   player The hero, or NULL
+ * \param   entity The entity, or NULL
+ */
+static void push_object(lua_State* L, KPlayer* player, KQEntity* entity)
+{
+    auto obj = static_cast<s_lua_object*>(lua_newuserdata(L, sizeof(s_lua_object)));
+    obj->player = player;
+    obj->entity = entity;
+    luaL_setmetatable(L, LUA_OBJ_META);
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
+}
+
+/*! \brief Get a hero or entity object from the stack
+ *
+ * \param   L the Lua state
+ * \param   pos position on the stack
+ * \returns the object, or NULL if it is anything else
+ */
+static s_lua_object* to_object(lua_State* L, int pos)
+{
+    return static_cast<s_lua_object*>(luaL_testudata(L, pos, LUA_OBJ_META));
+}
+
+/*! \brief Which property a metamethod was asked for
  *
- * Note that the field list MUST be sorted first
- * \author PH 20030309
- * \param   n The field name
- * \returns the index, or -1 if not found
+ * \param   L the Lua state; the key is at L::2
+ * \returns one of eObjectField, or -1 for a user-defined property
  */
-static int get_field(const char* n)
+static int object_field(lua_State* L)
 {
-    struct s_field* ans;
-    struct s_field st;
+    int isnum = 0;
 
-    st.name = n;
-    ans = (struct s_field*)bsearch(&st, fields, sizeof(fields) / sizeof(*fields), sizeof(struct s_field), fieldcmp);
-    return (ans ? ans->id : -1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    const int prop = static_cast<int>(lua_tointegerx(L, -1, &isnum));
+    lua_pop(L, 1);
+    return isnum ? prop : -1;
 }
 
 /*! \brief Initialize marker support
@@ -939,23 +1529,28 @@ static int get_field(const char* n)
  */
 static void init_markers(lua_State* L)
 {
-    lua_newtable(L);
+    /* Size the tables up front, and push the "x" and "y" keys only once */
+    lua_createtable(L, 0, g_map.markers.Size());
+    lua_pushliteral(L, "x");
+    lua_pushliteral(L, "y");
     for (size_t i = 0; i < g_map.markers.Size(); i++)
     {
         auto marker = g_map.markers.GetMarker(i);
-        if (marker != nullptr)
+        /* Only the first marker of each name, as KQ_find_marker() would find */
+        if (marker != nullptr && g_map.markers.GetMarker(marker->name) == marker)
         {
-            lua_pushstring(L, marker->name.c_str());
-            lua_newtable(L);
-            lua_pushstring(L, "x");
+            lua_pushlstring(L, marker->name.data(), marker->name.size());
+            lua_createtable(L, 0, 2);
+            lua_pushvalue(L, -4);
             lua_pushnumber(L, marker->x);
             lua_rawset(L, -3);
-            lua_pushstring(L, "y");
+            lua_pushvalue(L, -3);
             lua_pushnumber(L, marker->y);
             lua_rawset(L, -3);
-            lua_rawset(L, -3);
+            lua_rawset(L, -5);
         }
     }
+    lua_pop(L, 2);
     lua_setglobal(L, "markers");
 }
 
@@ -973,34 +1568,20 @@ static void init_obj(lua_State* L)
 {
     size_t i = 0;
 
-    /* do all the players */
-    lua_newtable(L);
-    lua_pushstring(L, "__index");
-    lua_pushcfunction(L, KQ_char_getter);
-    lua_settable(L, -3);
-    lua_pushstring(L, "__newindex");
-    lua_pushcfunction(L, KQ_char_setter);
-    lua_settable(L, -3);
-
+    /* do all the players; the ones in the party also have an entity */
     for (i = 0; i < MAXCHRS; ++i)
     {
-        lua_newtable(L);
-        lua_pushvalue(L, -2);
-        lua_setmetatable(L, -1);
-        lua_pushstring(L, LUA_PLR_KEY);
-        lua_pushlightuserdata(L, &party[i]);
-        lua_rawset(L, -3);
+        KQEntity* ent = NULL;
+        for (size_t p = 0; p < numchrs; ++p)
+        {
+            if (pidx[p] == (ePIDX)i)
+            {
+                ent = &g_ent[p];
+            }
+        }
+        push_object(L, &party[i], ent);
         lua_setglobal(L, party[i].name.c_str());
     }
-    /* party */
-    for (i = 0; i < numchrs; ++i)
-    {
-        lua_getglobal(L, party[pidx[i]].name.c_str());
-        /* also fill in the entity reference */
-        lua_pushstring(L, LUA_ENT_KEY);
-        lua_pushlightuserdata(L, &g_ent[i]);
-        lua_rawset(L, -3);
-    }
     /* party pseudo-array */
     lua_newtable(L);
     lua_newtable(L);
@@ -1025,12 +1606,7 @@ static void init_obj(lua_State* L)
     /* entities */
     for (i = 0; i < number_of_entities; ++i)
     {
-        lua_newtable(L);
-        lua_pushvalue(L, -2);
-        lua_setmetatable(L, -2);
-        lua_pushstring(L, LUA_ENT_KEY);
-        lua_pushlightuserdata(L, &g_ent[i + PSIZE]);
-        lua_rawset(L, -3);
+        push_object(L, NULL, &g_ent[i + PSIZE]);
         lua_rawseti(L, -2, i);
     }
     /* heroes */
@@ -1053,6 +1629,7 @@ static int KQ_add_chr(lua_State* L)
         g_ent[numchrs].eid = (int)a;
         g_ent[numchrs].chrx = 0;
         numchrs++;
+        update_entity(numchrs - 1);
     }
     return 0;
 }
@@ -1126,12 +1703,56 @@ static int KQ_remove_special_item(lua_State* L)
     return 0;
 }
 
+/*! \brief Call a function later
+ *
+ * Invocation: add_timer(func, delay [, interval [, arg, ...]])
+ * The function, or the name of one, is called with the arguments after
+ * delay seconds, and then every interval seconds if that is more than 0.
+ * Timers are cancelled when the map changes.
+ *
+ * \param   L::1 The function, or its name
+ * \param   L::2 Seconds before the first call
+ * \param   L::3 Seconds between calls, or 0 (the default) to call it once
+ * \param   L::4... Arguments for the function
+ * \returns a handle for cancel_timer()
+ */
 static int KQ_add_timer(lua_State* L)
 {
-    const char* funcname = lua_tostring(L, 1);
-    auto delta = lua_tointeger(L, 2);
+    const int nargs = std::max(lua_gettop(L) - 3, 0);
+    s_timer timer;
+
+    timer.interval = std::max(static_cast<int>(lua_tointeger(L, 3)), 0);
+    timer.nargs = nargs;
+    timer.args = LUA_NOREF;
+    if (nargs > 0)
+    {
+        lua_createtable(L, nargs, 0);
+        for (int i = 1; i <= nargs; ++i)
+        {
+            lua_pushvalue(L, 3 + i);
+            lua_rawseti(L, -2, i);
+        }
+        timer.args = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    if (lua_type(L, 1) == LUA_TSTRING)
+    {
+        get_script_value(L, lua_tostring(L, 1));
+    }
+    else
+    {
+        lua_pushvalue(L, 1);
+    }
+    if (!lua_isfunction(L, -1))
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, timer.args);
+        return luaL_error(L, "add_timer: %s is not a function", luaL_tolstring(L, 1, NULL));
+    }
+    timer.func = luaL_ref(L, LUA_REGISTRYINDEX);
 
-    lua_pushnumber(L, Game.add_timer_event(funcname, delta));
+    const int id = ++last_timer_id;
+    timers[id] = timer;
+    schedule_timer(id, ksec + lua_tointeger(L, 2));
+    lua_pushinteger(L, id);
     return 1;
 }
 
@@ -1188,6 +1809,26 @@ static int KQ_calc_viewport(lua_State* /*L*/)
     return 0;
 }
 
+/*! \brief Cancel a timer
+ *
+ * \param   L::1 Handle returned by add_timer()
+ * \returns true if the timer was still pending
+ */
+static int KQ_cancel_timer(lua_State* L)
+{
+    auto found = timers.find(lua_tointeger(L, 1));
+
+    if (found == timers.end())
+    {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    release_timer(found->second);
+    timers.erase(found);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 /*!\brief Change to a different map
  * \date Updated 20060709 TT: Now you can enter offsets from the marker's
  *       x and y coordinates to give more flexibility in movement
@@ -1221,69 +1862,63 @@ static int KQ_change_map(lua_State* L)
  */
 static int KQ_char_getter(lua_State* L)
 {
-    signed int prop;
+    const s_lua_object* obj = to_object(L, 1);
+    const int prop = object_field(L);
     int top;
-    KPlayer* pl;
-    KQEntity* ent;
 
-    prop = get_field(lua_tostring(L, 2));
     if (prop == -1)
     {
         /* it is a user-defined property, get it directly */
-        lua_rawget(L, 1);
+        lua_getuservalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
         return 1;
     }
-    lua_pushstring(L, LUA_PLR_KEY);
-    lua_rawget(L, 1);
-    pl = (KPlayer*)lua_touserdata(L, -1);
-    lua_pop(L, 1);
-    lua_pushstring(L, LUA_ENT_KEY);
-    lua_rawget(L, 1);
-    ent = (KQEntity*)lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    KPlayer* pl = obj->player;
+    KQEntity* ent = obj->entity;
     top = lua_gettop(L);
     if (pl)
     {
         /* These properties relate to s_player structures */
         switch (prop)
         {
-        case 0:
+        case FIELD_NAME:
             lua_pushstring(L, pl->name.c_str());
             break;
 
-        case 1:
+        case FIELD_XP:
             lua_pushnumber(L, pl->xp);
             break;
 
-        case 2:
+        case FIELD_NEXT:
             lua_pushnumber(L, pl->next);
             break;
 
-        case 3:
+        case FIELD_LVL:
             lua_pushnumber(L, pl->lvl);
             break;
 
-        case 4:
+        case FIELD_MRP:
             lua_pushnumber(L, pl->mrp);
             break;
 
-        case 5:
+        case FIELD_HP:
             lua_pushnumber(L, pl->hp);
             break;
 
-        case 6:
+        case FIELD_MHP:
             lua_pushnumber(L, pl->mhp);
             break;
 
-        case 7:
+        case FIELD_MP:
             lua_pushnumber(L, pl->mp);
             break;
 
-        case 8:
+        case FIELD_MMP:
             lua_pushnumber(L, pl->mmp);
             break;
 
-        case 9:
+        case FIELD_ID:
             lua_pushnumber(L, pl - party);
             break;
 
@@ -1296,36 +1931,37 @@ static int KQ_char_getter(lua_State* L)
         /* These properties relate to s_entity structures */
         switch (prop)
         {
-        case 10:
+        case FIELD_TILEX:
             lua_pushnumber(L, ent->tilex);
             break;
 
-        case 11:
+        case FIELD_TILEY:
             lua_pushnumber(L, ent->tiley);
             break;
 
-        case 12:
+        case FIELD_EID:
             lua_pushnumber(L, ent->eid);
             break;
 
-        case 13:
+        case FIELD_CHRX:
             lua_pushnumber(L, ent->chrx);
             break;
 
-        case 14:
+        case FIELD_FACING:
             lua_pushnumber(L, ent->facing);
             break;
 
-        case 15:
+        case FIELD_ACTIVE:
             lua_pushnumber(L, ent->active);
             break;
 
-        case 16:
+        case FIELD_SAY:
             lua_pushcfunction(L, KQ_bubble_ex);
             break;
 
-        case 17:
+        case FIELD_THINK:
             lua_pushcfunction(L, KQ_thought_ex);
+            break;
 
         default:
             break;
@@ -1349,67 +1985,62 @@ static int KQ_char_getter(lua_State* L)
  */
 static int KQ_char_setter(lua_State* L)
 {
-    int prop;
-    KPlayer* pl;
-    KQEntity* ent;
+    const s_lua_object* obj = to_object(L, 1);
+    const int prop = object_field(L);
 
-    prop = get_field(lua_tostring(L, 2));
     if (prop == -1)
     {
-        /* It is a user-defined property, set it directly in the table */
-        lua_rawset(L, 1);
+        /* It is a user-defined property, set it directly in the object's own table */
+        lua_getuservalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 3);
+        lua_rawset(L, -3);
         return 0;
     }
-    lua_pushstring(L, LUA_PLR_KEY);
-    lua_rawget(L, 1);
-    pl = (KPlayer*)lua_touserdata(L, -1);
-    lua_pop(L, 1);
-    lua_pushstring(L, LUA_ENT_KEY);
-    lua_rawget(L, 1);
-    ent = (KQEntity*)lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    KPlayer* pl = obj->player;
+    KQEntity* ent = obj->entity;
     if (pl)
     {
         /* These properties relate to 's_player' structures */
         switch (prop)
         {
-        case 0:
+        case FIELD_NAME:
             pl->name = lua_tostring(L, 3);
             break;
 
-        case 1:
+        case FIELD_XP:
             pl->xp = (int)lua_tonumber(L, 3);
             break;
 
-        case 2:
+        case FIELD_NEXT:
             pl->next = (int)lua_tonumber(L, 3);
             break;
 
-        case 3:
+        case FIELD_LVL:
             pl->lvl = (int)lua_tonumber(L, 3);
             break;
 
-        case 4:
+        case FIELD_MRP:
             pl->mrp = (int)lua_tonumber(L, 3);
             break;
 
-        case 5:
+        case FIELD_HP:
             pl->hp = (int)lua_tonumber(L, 3);
             break;
 
-        case 6:
+        case FIELD_MHP:
             pl->mhp = (int)lua_tonumber(L, 3);
             break;
 
-        case 7:
+        case FIELD_MP:
             pl->mp = (int)lua_tonumber(L, 3);
             break;
 
-        case 8:
+        case FIELD_MMP:
             pl->mmp = (int)lua_tonumber(L, 3);
             break;
 
-        case 9:
+        case FIELD_ID:
             /* id is readonly */
             break;
 
@@ -1422,33 +2053,34 @@ static int KQ_char_setter(lua_State* L)
         /* these properties relate to 's_entity' structures */
         switch (prop)
         {
-        case 10:
+        case FIELD_TILEX:
             ent->tilex = (int)lua_tonumber(L, 3);
             break;
 
-        case 11:
+        case FIELD_TILEY:
             ent->tiley = (int)lua_tonumber(L, 3);
             break;
 
-        case 12:
+        case FIELD_EID:
             ent->eid = (int)lua_tonumber(L, 3);
             break;
 
-        case 13:
+        case FIELD_CHRX:
             ent->chrx = (int)lua_tonumber(L, 3);
             break;
 
-        case 14:
+        case FIELD_FACING:
             ent->facing = (int)lua_tonumber(L, 3);
             break;
 
-        case 15:
+        case FIELD_ACTIVE:
             ent->active = (int)lua_tonumber(L, 3);
             break;
 
         default:
             break;
         }
+        update_entity(ent - g_ent);
     }
     return 0;
 }
@@ -1576,6 +2208,30 @@ static int KQ_copy_ent(lua_State* L)
     int b = real_entity_num(L, 2);
 
     g_ent[b] = g_ent[a];
+    sync_entities();
+    return 0;
+}
+
+/*! \brief Copy a block of the map, some layers only
+ *
+ * Invocation: copy_region(source_x, source_y, dest_x, dest_y, width,
+ *                         height, "layer", ...)
+ * Like copy_tile_all(), but only the named layers ("btile", "mtile",
+ * "ftile", "zone", "shadow" or "obs") are copied. With no names, all are.
+ *
+ * \param   L::1 The Lua VM
+ * \returns 0 (no values returned to Lua)
+ */
+static int KQ_copy_region(lua_State* L)
+{
+    unsigned int layers = 0;
+
+    for (int arg = 7; arg <= lua_gettop(L); ++arg)
+    {
+        layers |= 1u << region_layer(L, arg);
+    }
+    copy_region(lua_tointeger(L, 1), lua_tointeger(L, 2), lua_tointeger(L, 3), lua_tointeger(L, 4),
+                lua_tointeger(L, 5), lua_tointeger(L, 6), layers ? layers : ALL_MAP_LAYERS);
     return 0;
 }
 
@@ -1600,26 +2256,12 @@ static int KQ_copy_tile_all(lua_State* L)
     auto dy = lua_tointeger(L, 4);
     uint32_t wid = (uint32_t)lua_tonumber(L, 5);
     uint32_t hgt = (uint32_t)lua_tonumber(L, 6);
-    size_t os, od, i, j;
 
     /*
     sprintf (strbuf, "Copy (%d,%d)x(%d,%d) to (%d,%d)", sx, sy, wid, hgt, dx, dy);
     Game.klog(strbuf);
     */
-    for (j = 0; j < hgt; ++j)
-    {
-        for (i = 0; i < wid; ++i)
-        {
-            os = sx + i + g_map.xsize * (sy + j);
-            od = dx + i + g_map.xsize * (dy + j);
-            map_seg[od] = map_seg[os];
-            f_seg[od] = f_seg[os];
-            b_seg[od] = b_seg[os];
-            z_seg[od] = z_seg[os];
-            o_seg[od] = o_seg[os];
-            s_seg[od] = s_seg[os];
-        }
-    }
+    copy_region(sx, sy, dx, dy, wid, hgt, ALL_MAP_LAYERS);
     return 0;
 }
 
@@ -1658,8 +2300,8 @@ static int KQ_door_in(lua_State* L)
     hx = g_ent[0].tilex;
     hy = g_ent[0].tiley;
     hy2 = hy - 1;
-    db = map_seg[hy * g_map.xsize + hx];
-    dt = map_seg[hy2 * g_map.xsize + hx];
+    db = MapGrid.GetAt(MAP_LAYER_BTILE, hx, hy);
+    dt = MapGrid.GetAt(MAP_LAYER_BTILE, hx, hy2);
     if (g_map.tileset == 1)
     {
         set_btile(hx, hy, db + 433);
@@ -1810,6 +2452,32 @@ static int KQ_face_each_other(lua_State* L)
     return 0;
 }
 
+/*! \brief Set one layer over a block of the map
+ *
+ * Invocation: fill_region("layer", x, y, width, height, value)
+ * The layer is "btile", "mtile", "ftile", "zone", "shadow" or "obs".
+ * Much quicker than calling set_btile() etc. for every cell.
+ *
+ * \param   L::1 The Lua VM
+ * \returns 0 (no values returned to Lua)
+ */
+static int KQ_fill_region(lua_State* L)
+{
+    const eMapLayer layer = region_layer(L, 1);
+    const int x = lua_tointeger(L, 2);
+    const int y = lua_tointeger(L, 3);
+    const int w = lua_tointeger(L, 4);
+    const int h = lua_tointeger(L, 5);
+    const bool current = layer == MAP_LAYER_OBSTACLE && regions_current();
+
+    MapGrid.Fill(layer, x, y, w, h, lua_tointeger(L, 6));
+    if (current)
+    {
+        update_regions(x, y, w, h);
+    }
+    return 0;
+}
+
 static int KQ_gameover_ex(lua_State* L)
 {
     alldead = ((int)lua_tonumber(L, 1) == 0 ? 0 : 1);
@@ -1945,6 +2613,70 @@ static int KQ_get_ent_speed(lua_State* L)
     return 1;
 }
 
+/*! \brief Get the state of several entities at once
+ *
+ * This can be called within scripts like this:
+ *   local states = get_ent_states({0, 1, HERO1})
+ *   if states[1].tilex == states[2].tilex then ...
+ *
+ * Each state is a table of tilex, tiley, facing, movemode and active. A
+ * cutscene which checks its entities every frame can pass the tables it
+ * got last time back in, to have them filled in again rather than new
+ * ones made.
+ *
+ * \param   L::1 Table of entity indices or objects
+ * \param   L::2 Optional table of states to fill in
+ * \returns table of states, one for each entity in the same order
+ */
+static int KQ_get_ent_states(lua_State* L)
+{
+    if (!lua_istable(L, 1))
+    {
+        return luaL_error(L, "get_ent_states: expected a table of entities");
+    }
+    const int count = static_cast<int>(lua_rawlen(L, 1));
+
+    if (lua_istable(L, 2))
+    {
+        lua_settop(L, 2);
+    }
+    else
+    {
+        lua_settop(L, 1);
+        lua_createtable(L, count, 0);
+    }
+    for (int i = 1; i <= count; ++i)
+    {
+        lua_rawgeti(L, 1, i);
+        const int a = real_entity_num(L, -1);
+        lua_pop(L, 1);
+        if (a < 0 || a >= static_cast<int>(MAX_ENTITIES))
+        {
+            lua_pushboolean(L, 0);
+            lua_rawseti(L, 2, i);
+            continue;
+        }
+
+        lua_rawgeti(L, 2, i);
+        if (!lua_istable(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_createtable(L, 0, NUM_STATE_FIELDS);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, 2, i);
+        }
+        const KQEntity& ent = g_ent[a];
+        const int values[NUM_STATE_FIELDS] = { ent.tilex, ent.tiley, ent.facing, ent.movemode, ent.active };
+        for (int field = 0; field < NUM_STATE_FIELDS; ++field)
+        {
+            lua_pushinteger(L, values[field]);
+            lua_setfield(L, -2, state_names[field]);
+        }
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
 /*! \brief Return both x/y coords together
  *
  * This can be called within scripts like this:
@@ -2389,7 +3121,8 @@ static int KQ_inn(lua_State* L)
  */
 static int KQ_istable(lua_State* L)
 {
-    if (lua_istable(L, 1))
+    /* Hero and entity objects used to be tables, so they still count */
+    if (lua_istable(L, 1) || to_object(L, 1))
     {
         lua_pushnumber(L, 1);
     }
@@ -2544,6 +3277,11 @@ static int KQ_move_entity(lua_State* L)
 
     char buffer[1024];
 
+    if (entity_id < 0 || entity_id >= (int)MAX_ENTITIES)
+    {
+        return 0;
+    }
+
     if (lua_type(L, 2) == LUA_TSTRING)
     {
         shared_ptr<KMarker> m = KQ_find_marker(lua_tostring(L, 2), 1);
@@ -2561,7 +3299,11 @@ static int KQ_move_entity(lua_State* L)
         kill = (int)lua_tonumber(L, 4);
     }
 
-    find_path(entity_id, g_ent[entity_id].tilex, g_ent[entity_id].tiley, target_x, target_y, buffer, sizeof(buffer));
+    /*  Leave room for the kill command below; if there is no path the
+     *  buffer is left empty and the entity just stays put.
+     */
+    find_path(entity_id, g_ent[entity_id].tilex, g_ent[entity_id].tiley, target_x, target_y, buffer,
+              sizeof(buffer) - 1);
 
     /*  FIXME: The fourth parameter is a ugly hack for now.  */
     if (kill)
@@ -2636,6 +3378,48 @@ static int KQ_orient_heroes(lua_State* L)
     return 0;
 }
 
+/*! \brief Set one layer over a block of the map from a table
+ *
+ * Invocation: paste_region("layer", x, y, width, {values})
+ * The values go row by row, width to a row; the height is however many
+ * whole rows there are. The layer is as for fill_region().
+ *
+ * \param   L::1 The Lua VM
+ * \returns 0 (no values returned to Lua)
+ */
+static int KQ_paste_region(lua_State* L)
+{
+    const eMapLayer layer = region_layer(L, 1);
+    const int x = lua_tointeger(L, 2);
+    const int y = lua_tointeger(L, 3);
+    const int w = lua_tointeger(L, 4);
+
+    if (!lua_istable(L, 5))
+    {
+        return luaL_error(L, "paste_region: expected a table of values");
+    }
+    if (w <= 0)
+    {
+        return 0;
+    }
+    const int h = static_cast<int>(lua_rawlen(L, 5) / w);
+    std::vector<int> values(static_cast<size_t>(w) * h);
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        lua_rawgeti(L, 5, i + 1);
+        values[i] = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    const bool current = layer == MAP_LAYER_OBSTACLE && regions_current();
+    MapGrid.Paste(layer, x, y, w, h, values.data());
+    if (current)
+    {
+        update_regions(x, y, w, h);
+    }
+    return 0;
+}
+
 static int KQ_pause_song(lua_State* L)
 {
     (void)L;
@@ -3016,6 +3800,7 @@ static int KQ_set_ent_active(lua_State* L)
     if (b == 0 || b == 1)
     {
         g_ent[a].active = b;
+        update_entity(a);
     }
     return 0;
 }
@@ -3124,6 +3909,87 @@ static int KQ_set_ent_speed(lua_State* L)
     return 0;
 }
 
+/*! \brief Set the state of several entities at once
+ *
+ * This can be called within scripts like this:
+ *   set_ent_states({0, 1}, {{tilex = 10, facing = FACE_UP}, {active = 0}})
+ *
+ * The state tables are as returned by get_ent_states(); only the fields
+ * which are there are changed, and values which set_ent_facing() etc.
+ * would refuse are ignored.
+ *
+ * \param   L::1 Table of entity indices or objects
+ * \param   L::2 Table of states, one for each entity in the same order
+ */
+static int KQ_set_ent_states(lua_State* L)
+{
+    if (!lua_istable(L, 1) || !lua_istable(L, 2))
+    {
+        return luaL_error(L, "set_ent_states: expected tables of entities and states");
+    }
+    const int count = static_cast<int>(lua_rawlen(L, 1));
+
+    for (int i = 1; i <= count; ++i)
+    {
+        lua_rawgeti(L, 1, i);
+        const int a = real_entity_num(L, -1);
+        lua_pop(L, 1);
+        lua_rawgeti(L, 2, i);
+        if (a < 0 || a >= static_cast<int>(MAX_ENTITIES) || !lua_istable(L, -1))
+        {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        KQEntity& ent = g_ent[a];
+        for (int field = 0; field < NUM_STATE_FIELDS; ++field)
+        {
+            lua_getfield(L, -1, state_names[field]);
+            if (lua_isnumber(L, -1))
+            {
+                const int value = lua_tointeger(L, -1);
+                switch (field)
+                {
+                case STATE_TILEX:
+                    ent.tilex = value;
+                    ent.x = value * 16;
+                    break;
+
+                case STATE_TILEY:
+                    ent.tiley = value;
+                    ent.y = value * 16;
+                    break;
+
+                case STATE_FACING:
+                    if (value >= FACE_DOWN && value <= FACE_RIGHT)
+                    {
+                        ent.facing = value;
+                    }
+                    break;
+
+                case STATE_MOVEMODE:
+                    if (value >= 0 && value <= 3)
+                    {
+                        ent.movemode = value;
+                    }
+                    break;
+
+                case STATE_ACTIVE:
+                    if (value == 0 || value == 1)
+                    {
+                        ent.active = value;
+                    }
+                    break;
+                }
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        update_entity(a);
+    }
+    return 0;
+}
+
 /*! \brief Make entity go to a certain point
  *
  * Enter target move mode. (MM_TARGET) Entity
@@ -3150,6 +4016,7 @@ static int KQ_set_ent_tilex(lua_State* L)
 
     g_ent[a].tilex = (int)lua_tonumber(L, 2);
     g_ent[a].x = g_ent[a].tilex * 16;
+    update_entity(a);
     return 0;
 }
 
@@ -3159,6 +4026,7 @@ static int KQ_set_ent_tiley(lua_State* L)
 
     g_ent[a].tiley = (int)lua_tonumber(L, 2);
     g_ent[a].y = g_ent[a].tiley * 16;
+    update_entity(a);
     return 0;
 }
 
@@ -3250,18 +4118,20 @@ static int KQ_set_marker(lua_State* L)
     const int x_coord = lua_tonumber(L, 2);
     const int y_coord = lua_tonumber(L, 3);
 
-    shared_ptr<KMarker> m = KQ_find_marker(marker_name, 0);
+    shared_ptr<KMarker> m = KQ_find_marker(marker_name ? marker_name : "", 0);
     if (m == nullptr)
     {
         /* Need to add a new marker */
         auto new_marker = make_shared<KMarker>();
-        new_marker->name = marker_name;
+        new_marker->name = marker_name ? marker_name : "";
         new_marker->x = x_coord;
         new_marker->y = y_coord;
         g_map.markers.Add(new_marker);
     }
-    m->x = x_coord;
-    m->y = y_coord;
+    else
+    {
+        g_map.markers.Move(m, x_coord, y_coord);
+    }
 
     return 0;
 }
@@ -3950,24 +4820,58 @@ static int KQ_view_range(lua_State* L)
     return 0;
 }
 
+/*! \brief Wait for some game ticks
+ *
+ * In a script thread this suspends the thread, otherwise it runs the game
+ * until the time is up.
+ * \param L::1 Number of ticks
+ */
 static int KQ_wait(lua_State* L)
 {
-    Game.kwait((int)lua_tonumber(L, 1));
+    const int ticks = (int)lua_tonumber(L, 1);
+
+    if (L == running_script)
+    {
+        s_script_wait wait = { WAIT_TICKS, ticks, 0, 0 };
+        return wait_script(L, wait);
+    }
+    Game.kwait(ticks);
     return 0;
 }
 
+/*! \brief Wait for the ALT key
+ *
+ * In a script thread this suspends the thread, otherwise it waits here.
+ */
 static int KQ_wait_enter(lua_State* L)
 {
-    (void)L;
+    if (L == running_script)
+    {
+        s_script_wait wait = { WAIT_ENTER, 0, 0, 0 };
+        Game.unpress();
+        return wait_script(L, wait);
+    }
     Game.wait_enter();
     return 0;
 }
 
+/*! \brief Wait for entities to finish their scripted movement
+ *
+ * In a script thread this suspends the thread, otherwise it runs the game
+ * until they have finished.
+ * \param L::1 First entity
+ * \param L::2 Last entity, defaults to the first
+ */
 static int KQ_wait_for_entity(lua_State* L)
 {
     int a = real_entity_num(L, 1);
     int b = (lua_gettop(L) > 1 ? real_entity_num(L, 2) : a);
 
+    if (L == running_script)
+    {
+        s_script_wait wait = { WAIT_ENTITIES, 0, (size_t)std::min(a, b), (size_t)std::max(a, b) };
+        return wait_script(L, wait);
+    }
     Game.wait_for_entity(a, b);
     return 0;
 }
@@ -4034,23 +4938,20 @@ static int KQ_warp(lua_State* L)
  */
 int lua_dofile(lua_State* L, const char* filename)
 {
-    auto r = std::make_unique<readerbuf_t>();
-    r->in = fopen(filename, "rb");
-    int ret = 0;
+    const int ret = load_cached_script(L, filename);
 
-    if (r->in == NULL)
+    if (ret == LUA_ERRFILE)
     {
         TRACE("Could not open script %s!\n", filename);
         Game.program_death("Error opening script file");
     }
-    ret = lua_load(L, filereader, r.get(), filename, NULL);
-    fclose(r->in);
     if (ret != 0)
     {
         TRACE("Could not parse script %s!\n", get_filename(filename));
         Game.program_death("Script error");
     }
 
+    use_map_env(L);
     if (lua_pcall(L, 0, LUA_MULTRET, 0) != 0)
     {
         TRACE("lua_pcall failed while calling script %s!\n", get_filename(filename));
@@ -4082,6 +4983,8 @@ static int kq_dostring(lua_State* L, const char* cmd)
         scroll_console("Parse error");
         return retval;
     }
+    /* Run it where it can see the map's own functions */
+    use_map_env(L);
     /* Call it with no args and any number of return values */
     retval = lua_pcall(L, 0, LUA_MULTRET, 0);
     if (retval != 0)
@@ -4137,6 +5040,8 @@ void do_console_command(const char* cmd)
     if (theL != NULL)
     {
         kq_dostring(theL, cmd);
+        /* The command may have (re)defined a handler */
+        resolve_handlers();
     }
     else
     {
@@ -4156,6 +5061,41 @@ int KQ_print(lua_State* L)
     return 0;
 }
 
+/*! \brief Switch the script profiler on or off
+ *
+ * Typed in at the console, e.g. "profile(true)". The report for a map is
+ * written when the map is left, or when the profiler is switched off.
+ *
+ * \param L::1 true to start, false to stop; switches over if missing
+ * \returns whether the profiler is now running
+ */
+static int KQ_profile(lua_State* L)
+{
+    const bool on = lua_isnone(L, 1) ? !LuaProfiler.IsRunning() : lua_toboolean(L, 1) != 0;
+
+    if (on && !LuaProfiler.IsRunning())
+    {
+        LuaProfiler.Start(theL, lrs);
+        for (auto& script : script_threads)
+        {
+            LuaProfiler.Attach(script.thread);
+        }
+        scroll_console("Profiler on");
+    }
+    else if (!on && LuaProfiler.IsRunning())
+    {
+        LuaProfiler.Stop(theL);
+        for (auto& script : script_threads)
+        {
+            lua_sethook(script.thread, NULL, 0, 0);
+        }
+        LuaProfiler.Report(script_name);
+        scroll_console("Profiler off");
+    }
+    lua_pushboolean(L, LuaProfiler.IsRunning());
+    return 1;
+}
+
 /*! \brief Get party array
  *
  * Implement the getting of character objects from the party
@@ -4214,13 +5154,10 @@ static int KQ_party_setter(lua_State* L)
             g_ent[numchrs].active = 0;
             pidx[numchrs] = PIDX_UNDEFINED;
         }
-        else if (lua_istable(L, 3))
+        else if (to_object(L, 3))
         {
-            KPlayer* tt;
+            KPlayer* tt = to_object(L, 3)->player;
 
-            lua_pushstring(L, LUA_PLR_KEY);
-            lua_rawget(L, -2);
-            tt = (KPlayer*)lua_touserdata(L, -1);
             if (tt)
             {
                 /* OK so far */
@@ -4246,6 +5183,7 @@ static int KQ_party_setter(lua_State* L)
         {
             /* else, it wasn't a table */
         }
+        sync_entities();
     }
     return 0;
 }
@@ -4376,49 +5314,76 @@ static int real_entity_num(lua_State* L, int pos)
             return ee + PSIZE;
         }
     }
-    if (lua_istable(L, pos))
+    s_lua_object* obj = to_object(L, pos);
+    if (obj && obj->entity)
     {
-        KQEntity* ent;
-
-        lua_pushstring(L, LUA_ENT_KEY);
-        lua_rawget(L, pos);
-        ent = (KQEntity*)lua_touserdata(L, -1);
-        lua_pop(L, 1);
-        if (ent)
-        {
-            return ent - g_ent;
-        }
+        return obj->entity - g_ent;
     }
     return 255; /* means "nobody" */
 }
 
 static void set_btile(int x, int y, int value)
 {
-    map_seg[y * g_map.xsize + x] = value;
+    MapGrid.SetAt(MAP_LAYER_BTILE, x, y, value);
 }
 
 static void set_mtile(int x, int y, int value)
 {
-    b_seg[y * g_map.xsize + x] = value;
+    MapGrid.SetAt(MAP_LAYER_MTILE, x, y, value);
 }
 
 static void set_ftile(int x, int y, int value)
 {
-    f_seg[y * g_map.xsize + x] = value;
+    MapGrid.SetAt(MAP_LAYER_FTILE, x, y, value);
 }
 
 static void set_zone(int x, int y, int value)
 {
-    z_seg[y * g_map.xsize + x] = value;
+    MapGrid.SetAt(MAP_LAYER_ZONE, x, y, value);
 }
 
 static void set_obs(int x, int y, int value)
 {
-    o_seg[y * g_map.xsize + x] = value;
+    set_obstacle(x, y, value);
 }
 
 static void set_shadow(int x, int y, int value)
 {
-    size_t index = y * g_map.xsize + x;
-    s_seg[index] = value;
+    MapGrid.SetAt(MAP_LAYER_SHADOW, x, y, value);
+}
+
+/* Names of the map layers for the region functions, in eMapLayer order */
+static const char* const layer_names[NUM_MAP_LAYERS] = { "btile", "mtile", "ftile", "zone", "shadow", "obs" };
+
+/*! \brief Get a map layer from its name
+ *
+ * \param   L The Lua VM
+ * \param   index Stack index of the name
+ * \returns the layer; raises a Lua error if the name is not one of layer_names
+ */
+static eMapLayer region_layer(lua_State* L, int index)
+{
+    const char* name = lua_tostring(L, index);
+
+    for (int layer = 0; layer < NUM_MAP_LAYERS; ++layer)
+    {
+        if (name && strcmp(name, layer_names[layer]) == 0)
+        {
+            return static_cast<eMapLayer>(layer);
+        }
+    }
+    luaL_error(L, "Unknown map layer '%s'", name ? name : "nil");
+    return NUM_MAP_LAYERS;
+}
+
+/*! \brief Copy a block of the map, keeping the movement regions up to date */
+static void copy_region(int sx, int sy, int dx, int dy, int w, int h, unsigned int layers)
+{
+    const bool current = (layers & (1u << MAP_LAYER_OBSTACLE)) && regions_current();
+
+    MapGrid.Copy(sx, sy, dx, dy, w, h, layers);
+    if (current)
+    {
+        update_regions(dx, dy, w, h);
+    }
 }
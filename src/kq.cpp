@@ -52,6 +52,7 @@
 #include "credits.h"
 #include "disk.h"
 #include "draw.h"
+#include "enemyc.h"
 #include "entity.h"
 #include "enums.h"
 #include "fade.h"
@@ -62,15 +63,20 @@
 #include "itemmenu.h"
 #include "kq.h"
 #include "magic.h"
+#include "mapgrid.h"
+#include "mappreload.h"
 #include "masmenu.h"
 #include "menu.h"
+#include "movement.h"
 #include "mpcx.h"
 #include "music.h"
 #include "platform.h"
 #include "res.h"
+#include "scriptcache.h"
 #include "setup.h"
 #include "sgame.h"
 #include "shopmenu.h"
+#include "startup.h"
 #include "structs.h"
 #include "tiledmap.h"
 
@@ -79,6 +85,7 @@
 
 static void my_counter(void);
 static void time_counter(void);
+static void slice_misc(void);
 
 KGame Game;
 
@@ -95,8 +102,6 @@ Raster *double_buffer, *fx_buffer, *map_icons[MAX_TILES], *back, *tc, *tc2, *bub
 Raster* obj_mesh;
 #endif
 
-uint16_t *map_seg = NULL, *b_seg = NULL, *f_seg = NULL;
-uint8_t *z_seg = NULL, *s_seg = NULL, *o_seg = NULL;
 uint8_t progress[SIZE_PROGRESS];
 uint8_t treasure[SIZE_TREASURE];
 uint8_t save_spells[SIZE_SAVE_SPELL];
@@ -247,17 +252,8 @@ int no_monsters = 0;
 int every_hit_999 = 0;
 #endif
 
-/*! \brief Timer Event structure
- *
- * Holds the information relating to a forthcoming event
- */
-static struct timer_event
-{
-    char name[32]; /*!< Name of the event */
-    int when;      /*!< Time when it will trigger */
-} timer_events[5];
-
-static int next_event_time; /*!< The time the next event will trigger */
+/*! Print per-phase timings at the end of startup (--startup-profile) */
+static bool show_startup_profile = false;
 
 #ifdef DEBUGMODE
 /* OC: Almost 100% of these have been converted to LUA, with the names defined
@@ -319,7 +315,7 @@ KGame::KGame()
 
 void KGame::activate(void)
 {
-    int zx, zy, looking_at_x = 0, looking_at_y = 0, q, target_char_facing = 0, tf;
+    int zx, zy, looking_at_x = 0, looking_at_y = 0, target_char_facing = 0, tf;
 
     uint32_t p;
 
@@ -360,11 +356,10 @@ void KGame::activate(void)
     looking_at_x += zx;
     looking_at_y += zy;
 
-    q = looking_at_y * g_map.xsize + looking_at_x;
-
-    if (o_seg[q] != BLOCK_NONE && z_seg[q] > 0)
+    const KMapCell* cell = MapGrid.CellAt(looking_at_x, looking_at_y);
+    if (cell && cell->obstacle != BLOCK_NONE && cell->zone > 0)
     {
-        do_zone(z_seg[q]);
+        do_zone(cell->zone);
     }
 
     p = entityat(looking_at_x, looking_at_y, 0);
@@ -395,27 +390,6 @@ void KGame::activate(void)
     }
 }
 
-int KGame::add_timer_event(const char* n, int delta)
-{
-    int w = delta + ksec;
-    int i;
-
-    for (i = 0; i < 5; ++i)
-    {
-        if (*timer_events[i].name == '\0')
-        {
-            memcpy(timer_events[i].name, n, sizeof(timer_events[i].name));
-            if (w < next_event_time)
-            {
-                next_event_time = w;
-            }
-            timer_events[i].when = w;
-            return i;
-        }
-    }
-    return -1;
-}
-
 #ifdef DEBUGMODE
 
 Raster* KGame::alloc_bmp(int bitmap_width, int bitmap_height, const char* bitmap_name)
@@ -756,30 +730,8 @@ void KGame::deallocate_stuff(void)
         delete (map_icons[p]);
     }
 
-    if (map_seg)
-    {
-        free(map_seg);
-    }
-    if (b_seg)
-    {
-        free(b_seg);
-    }
-    if (f_seg)
-    {
-        free(f_seg);
-    }
-    if (z_seg)
-    {
-        free(z_seg);
-    }
-    if (s_seg)
-    {
-        free(s_seg);
-    }
-    if (o_seg)
-    {
-        free(o_seg);
-    }
+    MapPreloader.Stop();
+    MapGrid.Clear();
     if (strbuf)
     {
         free(strbuf);
@@ -798,43 +750,6 @@ void KGame::deallocate_stuff(void)
 #endif
 }
 
-char* KGame::get_timer_event(void)
-{
-    static char buf[32];
-    int now = ksec;
-    int i;
-    int next = INT_MAX;
-    struct timer_event* t;
-
-    if (now < next_event_time)
-    {
-        return NULL;
-    }
-
-    *buf = '\0';
-    for (i = 0; i < 5; ++i)
-    {
-        t = &timer_events[i];
-        if (*t->name)
-        {
-            if (t->when <= now)
-            {
-                memcpy(buf, t->name, sizeof(buf));
-                *t->name = '\0';
-            }
-            else
-            {
-                if (t->when < next)
-                {
-                    next = t->when;
-                }
-            }
-        }
-    }
-    next_event_time = next;
-    return *buf ? buf : NULL;
-}
-
 size_t KGame::in_party(ePIDX pn)
 {
     size_t pidx_index;
@@ -920,8 +835,6 @@ void KGame::load_heroes(void)
         program_death(_("Could not load character graphics!"));
     }
 
-    set_palette(pal);
-
     for (int party_index = 0; party_index < MAXCHRS; party_index++)
     {
         for (int frame_index = 0; frame_index < MAXFRAMES; frame_index++)
@@ -958,6 +871,16 @@ int main(int argc, const char* argv[])
             skip_splash = 1;
         }
 
+        if (!strcmp(argv[i], "--startup-profile"))
+        {
+            show_startup_profile = true;
+        }
+
+        if (!strcmp(argv[i], "--precompile-scripts"))
+        {
+            return precompile_scripts() ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
         if (!strcmp(argv[i], "--help"))
         {
             printf(_("Sorry, no help screen at this time.\n"));
@@ -998,17 +921,21 @@ int main(int argc, const char* argv[])
             /* While the actual game is playing */
             while (!stop)
             {
+                int ticks = 0;
                 while (timer_count > 0)
                 {
                     timer_count--;
+                    ++ticks;
                     process_entities();
                 }
+                run_scripts(ticks);
                 Game.do_check_animation();
                 Draw.drawmap();
                 Draw.blit2screen(xofs, yofs);
                 Music.poll_music();
 
-                if (key[PlayerInput.kesc])
+                /* No saving in the middle of a cutscene */
+                if (key[PlayerInput.kesc] && !scripts_waiting())
                 {
                     stop = SaveGame.system_menu();
                 }
@@ -1061,48 +988,13 @@ void KGame::prepare_map(int msx, int msy, int mvx, int mvy)
 {
     Raster* pcxb;
     unsigned int i;
-    size_t mapsize;
     unsigned int o;
 
-    mapsize = (size_t)g_map.xsize * (size_t)g_map.ysize;
-
-    draw_background = draw_middle = draw_foreground = draw_shadow = 0;
-
-    for (i = 0; i < mapsize; i++)
-    {
-        if (map_seg[i] > 0)
-        {
-            draw_background = 1;
-            break;
-        }
-    }
-
-    for (i = 0; i < mapsize; i++)
-    {
-        if (b_seg[i] > 0)
-        {
-            draw_middle = 1;
-            break;
-        }
-    }
-
-    for (i = 0; i < mapsize; i++)
-    {
-        if (f_seg[i] > 0)
-        {
-            draw_foreground = 1;
-            break;
-        }
-    }
-
-    for (i = 0; i < mapsize; i++)
-    {
-        if (s_seg[i] > 0)
-        {
-            draw_shadow = 1;
-            break;
-        }
-    }
+    draw_background = MapGrid.LayerUsed(MAP_LAYER_BTILE);
+    draw_middle = MapGrid.LayerUsed(MAP_LAYER_MTILE);
+    draw_foreground = MapGrid.LayerUsed(MAP_LAYER_FTILE);
+    draw_shadow = MapGrid.LayerUsed(MAP_LAYER_SHADOW);
+    update_regions();
 
     for (i = 0; i < (size_t)numchrs; i++)
     {
@@ -1184,6 +1076,7 @@ void KGame::prepare_map(int msx, int msy, int mvx, int mvy)
         g_ent[i].active = 1;
     }
 
+    sync_entities();
     count_entities();
 
     for (i = 0; i < MAX_ENTITIES; i++)
@@ -1232,17 +1125,6 @@ void KGame::program_death(const char* message)
     exit(EXIT_FAILURE);
 }
 
-void KGame::reset_timer_events(void)
-{
-    int i;
-
-    for (i = 0; i < 5; ++i)
-    {
-        *timer_events[i].name = '\0';
-    }
-    next_event_time = INT_MAX;
-}
-
 void KGame::reset_world(void)
 {
     int i, j;
@@ -1278,68 +1160,14 @@ void KGame::reset_world(void)
     lua_user_init();
 }
 
-void KGame::startup(void)
+/*! \brief Cut the small interface bitmaps out of misc.png
+ *
+ * Only touches bitmaps created by allocate_stuff(), so it is safe to run
+ * on a startup worker thread.
+ */
+static void slice_misc(void)
 {
-    int p, i, q;
-    time_t t;
-
-    allegro_init();
-
-    /* Buffers to allocate */
-    strbuf = (char*)malloc(4096);
-
-    map_seg = b_seg = f_seg = NULL;
-    s_seg = z_seg = o_seg = NULL;
-
-    allocate_stuff();
-    //install_keyboard();
-    install_timer();
-
-    /* KQ uses digi sound but it doesn't use MIDI */
-    //   reserve_voices (8, 0);
-    sound_avail = (install_sound(DIGI_AUTODETECT, MIDI_NONE, NULL) < 0 ? 0 : 1);
-    if (!sound_avail)
-    {
-        TRACE(_("Error with sound: %s\n"), allegro_error);
-    }
-    parse_setup();
-    sound_init();
-    set_graphics_mode();
-
-    if (use_joy == 1)
-    {
-        install_joystick(JOY_TYPE_AUTODETECT);
-    }
-
-    if (num_joysticks == 0)
-    {
-        use_joy = 0;
-    }
-    else
-    {
-        use_joy = 0;
-
-        if (poll_joystick() == 0)
-        {
-            // Use first compatible joystick attached to computer
-            for (i = 0; i < num_joysticks; ++i)
-            {
-                if (joy[i].num_buttons >= 4)
-                {
-                    use_joy = i + 1;
-                    break;
-                }
-            }
-        }
-
-        if (use_joy == 0)
-        {
-            Game.klog(_("Only joysticks/gamepads with at least 4 buttons can be used."));
-            remove_joystick();
-        }
-    }
-
-    srand((unsigned)time(&t));
+    int p, i;
     Raster* misc = get_cached_image("misc.png");
     misc->blitTo(menuptr, 24, 0, 0, 0, 16, 8);
     misc->blitTo(sptr, 0, 0, 0, 0, 8, 8);
@@ -1412,47 +1240,137 @@ void KGame::startup(void)
     {
         misc->blitTo(pgb[i], i * 16, 48, 0, 0, 9, 9);
     }
+}
 
-    load_heroes();
+/*! \brief Find a usable joystick, if joysticks are enabled in the setup */
+static void init_joystick(void)
+{
+    if (use_joy == 1)
+    {
+        install_joystick(JOY_TYPE_AUTODETECT);
+    }
 
-    Raster* allfonts = get_cached_image("fonts.png");
-    allfonts->blitTo(kfonts, 0, 0, 0, 0, 1024, 60);
-    Raster* entities = get_cached_image("entities.png");
-    for (q = 0; q < MAXE; q++)
+    if (num_joysticks == 0)
+    {
+        use_joy = 0;
+    }
+    else
     {
-        for (p = 0; p < MAXEFRAMES; p++)
+        use_joy = 0;
+
+        if (poll_joystick() == 0)
         {
-            entities->blitTo(eframes[q][p], p * 16, q * 16, 0, 0, 16, 16);
+            // Use first compatible joystick attached to computer
+            for (int i = 0; i < num_joysticks; ++i)
+            {
+                if (joy[i].num_buttons >= 4)
+                {
+                    use_joy = i + 1;
+                    break;
+                }
+            }
+        }
+
+        if (use_joy == 0)
+        {
+            Game.klog(_("Only joysticks/gamepads with at least 4 buttons can be used."));
+            remove_joystick();
         }
     }
+}
+
+void KGame::startup(void)
+{
+    KStartupTasks tasks;
+
+    allegro_init();
+
+    /* Buffers to allocate */
+    strbuf = (char*)malloc(4096);
 
-    LOCK_VARIABLE(timer);
-    LOCK_VARIABLE(timer_count);
-    LOCK_VARIABLE(animation_count);
-    LOCK_VARIABLE(ksec);
-    LOCK_VARIABLE(kmin);
-    LOCK_VARIABLE(khr);
-    LOCK_FUNCTION(my_counter);
-    LOCK_FUNCTION(time_counter);
+    allocate_stuff();
+    //install_keyboard();
+    install_timer();
 
-    install_int_ex(my_counter, BPS_TO_TIMER(KQ_TICKS));
-    /* tick every minute */
-    install_int_ex(time_counter, BPM_TO_TIMER(1));
-    create_trans_table(&cmap, pal, 128, 128, 128, NULL);
-    color_map = &cmap;
-    SaveGame.load_sgstats();
+    /* KQ uses digi sound but it doesn't use MIDI */
+    //   reserve_voices (8, 0);
+    sound_avail = (install_sound(DIGI_AUTODETECT, MIDI_NONE, NULL) < 0 ? 0 : 1);
+    if (!sound_avail)
+    {
+        TRACE(_("Error with sound: %s\n"), allegro_error);
+    }
+    parse_setup();
+
+    /* Anything that talks to Allegro's drivers stays on this thread, in its
+     * original order. The rest only reads data files and writes into the
+     * bitmaps made by allocate_stuff(), so it goes to the worker threads.
+     */
+    auto sound = tasks.Add("sound_init", []() { sound_init(); }, {}, true);
+    auto graphics = tasks.Add("graphics_mode",
+                              []() {
+                                  set_graphics_mode();
+                                  init_joystick();
+                              },
+                              { sound }, true);
+    tasks.Add("trans_table",
+              []() {
+                  create_trans_table(&cmap, pal, 128, 128, 128, NULL);
+                  color_map = &cmap;
+              });
+    tasks.Add("misc.png", []() { slice_misc(); });
+    tasks.Add("load_heroes", [this]() { load_heroes(); });
+    tasks.Add("fonts",
+              []() {
+                  Raster* allfonts = get_cached_image("fonts.png");
+                  allfonts->blitTo(kfonts, 0, 0, 0, 0, 1024, 60);
+              });
+    tasks.Add("entity_frames",
+              []() {
+                  Raster* entities = get_cached_image("entities.png");
+                  for (int q = 0; q < MAXE; q++)
+                  {
+                      for (int p = 0; p < MAXEFRAMES; p++)
+                      {
+                          entities->blitTo(eframes[q][p], p * 16, q * 16, 0, 0, 16, 16);
+                      }
+                  }
+              });
+    tasks.Add("load_sgstats", []() { SaveGame.load_sgstats(); });
+    tasks.Add("enemy_data", []() { Enemy.LoadEnemies(); });
+
+    tasks.Add("timers",
+              [this]() {
+                  time_t t;
+                  srand((unsigned)time(&t));
+
+                  LOCK_VARIABLE(timer);
+                  LOCK_VARIABLE(timer_count);
+                  LOCK_VARIABLE(animation_count);
+                  LOCK_VARIABLE(ksec);
+                  LOCK_VARIABLE(kmin);
+                  LOCK_VARIABLE(khr);
+                  LOCK_FUNCTION(my_counter);
+                  LOCK_FUNCTION(time_counter);
+
+                  install_int_ex(my_counter, BPS_TO_TIMER(KQ_TICKS));
+                  /* tick every minute */
+                  install_int_ex(time_counter, BPM_TO_TIMER(1));
+              },
+              { graphics }, true);
+
+    tasks.Run(KStartupTasks::DefaultWorkers());
 
 #ifdef DEBUGMODE
     /* TT: Create the mesh object to see 4-way obstacles (others ignored) */
     obj_mesh = new Raster(16, 16);
     clear_bitmap(obj_mesh);
-    for (q = 0; q < 16; q += 2)
+    for (int q = 0; q < 16; q += 2)
     {
-        for (p = 0; p < TILE_W; p += 2)
+        for (int p = 0; p < TILE_W; p += 2)
         {
             putpixel(obj_mesh, p, q, 255);
         }
-        for (p = 1; p < TILE_W; p += 2)
+        for (int p = 1; p < TILE_W; p += 2)
         {
             putpixel(obj_mesh, p, q + 1, 255);
         }
@@ -1460,6 +1378,11 @@ void KGame::startup(void)
 #endif
 
     init_console();
+
+    if (show_startup_profile)
+    {
+        tasks.Report(stdout);
+    }
 }
 
 /*! \brief Keep track of the time the game has been in play
@@ -1515,10 +1438,6 @@ void KGame::wait_enter(void)
 
 void KGame::wait_for_entity(size_t first_entity_index, size_t last_entity_index)
 {
-    int any_following_entities;
-    uint8_t move_mode;
-    size_t entity_index;
-
     if (first_entity_index > last_entity_index)
     {
         int temp = first_entity_index;
@@ -1549,19 +1468,21 @@ void KGame::wait_for_entity(size_t first_entity_index, size_t last_entity_index)
         {
             program_death(_("X-Alt pressed - exiting"));
         }
+    } while (scripted_movement(first_entity_index, last_entity_index));
+    autoparty = 0;
+}
 
-        any_following_entities = 0;
-        for (entity_index = first_entity_index; entity_index <= last_entity_index; ++entity_index)
+bool KGame::scripted_movement(size_t first_entity_index, size_t last_entity_index)
+{
+    for (size_t entity_index = first_entity_index; entity_index <= last_entity_index; ++entity_index)
+    {
+        uint8_t move_mode = g_ent[entity_index].movemode;
+        if (g_ent[entity_index].active == 1 && (move_mode == MM_SCRIPT || move_mode == MM_TARGET))
         {
-            move_mode = g_ent[entity_index].movemode;
-            if (g_ent[entity_index].active == 1 && (move_mode == MM_SCRIPT || move_mode == MM_TARGET))
-            {
-                any_following_entities = 1;
-                break; // for()
-            }
+            return true;
         }
-    } while (any_following_entities);
-    autoparty = 0;
+    }
+    return false;
 }
 
 void KGame::warp(int wtx, int wty, int fspeed)
@@ -1636,7 +1557,7 @@ void KGame::zone_check(void)
         }
     }
 
-    stc = z_seg[zy * g_map.xsize + zx];
+    stc = MapGrid.GetAt(MAP_LAYER_ZONE, zx, zy);
 
     if (g_map.zero_zone != 0)
     {
@@ -0,0 +1,245 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*! \file
+ * \brief Sampling profiler for the Lua scripts
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <set>
+
+extern "C" {
+#include <lauxlib.h>
+#include <lua.h>
+}
+
+#include "console.h"
+#include "luaprof.h"
+#include "platform.h"
+
+using std::string;
+using std::vector;
+
+KLuaProfiler LuaProfiler;
+
+/*! Lua instructions between samples */
+static const int SAMPLE_INSTRUCTIONS = 1000;
+
+/*! Longest gap between two samples which counts as time spent in Lua. A
+ * longer one means the scripts weren't running in between, and is only
+ * charged this much.
+ */
+static const double MAX_SAMPLE_MS = 5.0;
+
+static double milliseconds(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+/*! \brief How a stack frame is shown in the report: source:line (name) */
+static string frame_name(const lua_Debug& ar)
+{
+    string name;
+    if (ar.what[0] == 'C')
+    {
+        name = "[C]";
+    }
+    else
+    {
+        name = string(ar.short_src) + ":" + std::to_string(ar.linedefined);
+    }
+    if (ar.name)
+    {
+        name += string(" (") + ar.name + ")";
+    }
+    return name;
+}
+
+void KLuaProfiler::Start(lua_State* L, const luaL_Reg* bindings)
+{
+    if (IsRunning())
+    {
+        return;
+    }
+    m_bindings = bindings;
+    m_wrapped = bindings;
+    m_binding_names.clear();
+    for (const luaL_Reg* reg = bindings; reg->name; ++reg)
+    {
+        m_binding_names.push_back(reg->name);
+        lua_pushinteger(L, reg - bindings);
+        lua_pushcclosure(L, CallBinding, 1);
+        lua_setglobal(L, reg->name);
+    }
+    m_calls.resize(m_binding_names.size());
+    m_last_sample = std::chrono::steady_clock::now();
+    Attach(L);
+}
+
+void KLuaProfiler::Stop(lua_State* L)
+{
+    if (!IsRunning())
+    {
+        return;
+    }
+    lua_sethook(L, NULL, 0, 0);
+    for (const luaL_Reg* reg = m_bindings; reg->name; ++reg)
+    {
+        lua_register(L, reg->name, reg->func);
+    }
+    m_bindings = nullptr;
+}
+
+void KLuaProfiler::Attach(lua_State* thread)
+{
+    lua_sethook(thread, Hook, LUA_MASKCOUNT, SAMPLE_INSTRUCTIONS);
+}
+
+void KLuaProfiler::Report(const string& name)
+{
+    if (m_functions.empty() &&
+        std::none_of(m_calls.begin(), m_calls.end(), [](const s_binding_stats& c) { return c.calls > 0; }))
+    {
+        return;
+    }
+
+    const string path = kqres(SETTINGS_DIR, "profile-" + name + ".txt");
+    FILE* out = fopen(path.c_str(), "w");
+    if (out)
+    {
+        vector<std::pair<string, s_function_stats>> functions(m_functions.begin(), m_functions.end());
+        std::sort(functions.begin(), functions.end(),
+                  [](const std::pair<string, s_function_stats>& a, const std::pair<string, s_function_stats>& b) {
+                      return a.second.self_ms > b.second.self_ms;
+                  });
+        fprintf(out, "Lua functions\n%10s %10s %10s  %s\n", "samples", "self ms", "incl ms", "function");
+        for (auto& f : functions)
+        {
+            fprintf(out, "%10lu %10.2f %10.2f  %s\n", f.second.samples, f.second.self_ms, f.second.inclusive_ms,
+                    f.first.c_str());
+        }
+
+        vector<size_t> order;
+        for (size_t i = 0; i < m_calls.size(); ++i)
+        {
+            if (m_calls[i].calls > 0)
+            {
+                order.push_back(i);
+            }
+        }
+        std::sort(order.begin(), order.end(),
+                  [this](size_t a, size_t b) { return m_calls[a].inclusive_ms > m_calls[b].inclusive_ms; });
+        fprintf(out, "\nEngine functions\n%10s %10s  %s\n", "calls", "incl ms", "function");
+        for (size_t i : order)
+        {
+            fprintf(out, "%10lu %10.2f  %s\n", m_calls[i].calls, m_calls[i].inclusive_ms, m_binding_names[i].c_str());
+        }
+        fclose(out);
+    }
+
+    const string folded = kqres(SETTINGS_DIR, "profile-" + name + ".folded");
+    out = fopen(folded.c_str(), "w");
+    if (out)
+    {
+        for (auto& stack : m_stacks)
+        {
+            fprintf(out, "%s %lu\n", stack.first.c_str(), stack.second);
+        }
+        fclose(out);
+    }
+
+    scroll_console(("Profile written to " + path).c_str());
+    m_functions.clear();
+    m_stacks.clear();
+    m_calls.assign(m_calls.size(), s_binding_stats());
+}
+
+/*! \brief Count hook: take a sample */
+void KLuaProfiler::Hook(lua_State* L, lua_Debug*)
+{
+    LuaProfiler.Sample(L);
+}
+
+/*! \brief Stands in for one of the engine's C functions while profiling
+ *
+ * The index of the function in the bindings is upvalue 1.
+ */
+int KLuaProfiler::CallBinding(lua_State* L)
+{
+    KLuaProfiler& self = LuaProfiler;
+    const size_t index = static_cast<size_t>(lua_tointeger(L, lua_upvalueindex(1)));
+
+    if (!self.IsRunning())
+    {
+        /* A copy kept by a script after Stop(): just pass the call on */
+        return self.m_wrapped[index].func(L);
+    }
+    /* Count the call first: a function which yields doesn't come back here */
+    ++self.m_calls[index].calls;
+    const auto start = std::chrono::steady_clock::now();
+    const int results = self.m_bindings[index].func(L);
+    self.m_calls[index].inclusive_ms += milliseconds(std::chrono::steady_clock::now() - start);
+    return results;
+}
+
+/*! \brief Charge the time since the last sample to the current stack */
+void KLuaProfiler::Sample(lua_State* L)
+{
+    if (!IsRunning())
+    {
+        return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    const double elapsed = std::min(milliseconds(now - m_last_sample), MAX_SAMPLE_MS);
+    m_last_sample = now;
+
+    vector<string> frames;
+    lua_Debug ar;
+    for (int level = 0; lua_getstack(L, level, &ar); ++level)
+    {
+        lua_getinfo(L, "Sn", &ar);
+        frames.push_back(frame_name(ar));
+    }
+    if (frames.empty())
+    {
+        return;
+    }
+
+    s_function_stats& top = m_functions[frames.front()];
+    ++top.samples;
+    top.self_ms += elapsed;
+    /* Recursive functions are only charged once per sample */
+    std::set<string> seen;
+    string stack;
+    for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame)
+    {
+        if (seen.insert(*frame).second)
+        {
+            m_functions[*frame].inclusive_ms += elapsed;
+        }
+        string part = *frame;
+        std::replace(part.begin(), part.end(), ';', ':');
+        std::replace(part.begin(), part.end(), ' ', '_');
+        stack += (stack.empty() ? "" : ";") + part;
+    }
+    ++m_stacks[stack];
+}
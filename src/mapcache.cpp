@@ -0,0 +1,517 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*! \file
+ * \brief Compiled binary map cache
+ *
+ * Layout of a .kqmap file (all values in host byte order; a file written
+ * on a different machine just fails the header check and gets rebuilt):
+ *
+ * - header: magic, format version, sizeof(KQEntity), TMX path, size, mtime
+ * - map properties
+ * - tilesets: .tsx reference (path, size, mtime) and firstgid; embedded
+ *   tilesets also carry their data, external ones come from the registry
+ * - bounds, markers, zones, entities
+ * - layers: name, width, height then the raw GIDs
+ *
+ * Strings are stored as a 32-bit length followed by the characters.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "kq.h"
+#include "mapcache.h"
+#include "platform.h"
+#include "tiledmap.h"
+
+using std::string;
+
+static const char KQMAP_MAGIC[8] = { 'K', 'Q', 'M', 'A', 'P', 0, 0, 0 };
+static const uint32_t KQMAP_VERSION = 2;
+
+/*! \brief Size and modification time of a file
+ * \param   path File to look at
+ * \param   size Set to the file size
+ * \param   mtime Set to the modification time
+ * \returns true if the file exists
+ */
+static bool file_stamp(const string& path, uint64_t& size, int64_t& mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtime);
+    return true;
+}
+
+/*! \brief Where the cache for a TMX file lives
+ * \param   source Full path of the TMX file
+ * \returns path in the cache directory
+ */
+static string cache_path(const string& source)
+{
+    size_t slash = source.find_last_of("/\\");
+    string base = source.substr(slash == string::npos ? 0 : slash + 1);
+    size_t dot = base.rfind('.');
+    if (dot != string::npos)
+    {
+        base.erase(dot);
+    }
+    return kqres(CACHE_DIR, base + ".kqmap");
+}
+
+/*! \brief Serialise values into a byte buffer */
+class cache_writer
+{
+  public:
+    template<typename T> void put(const T& value)
+    {
+        const char* ptr = reinterpret_cast<const char*>(&value);
+        buffer.append(ptr, sizeof(T));
+    }
+    void put_string(const string& str)
+    {
+        put(static_cast<uint32_t>(str.size()));
+        buffer.append(str);
+    }
+    void put_bytes(const void* ptr, size_t size)
+    {
+        buffer.append(static_cast<const char*>(ptr), size);
+    }
+    string buffer;
+};
+
+/*! \brief Read values back from a mapped cache file
+ *
+ * Every read is bounds checked; once anything fails all further reads
+ * fail too, so the caller only needs to check ok() at the end.
+ */
+class cache_reader
+{
+  public:
+    cache_reader(const char* data, size_t size)
+        : ptr(data)
+        , end(data + size)
+        , good(true)
+    {
+    }
+    template<typename T> T get()
+    {
+        T value = T();
+        get_bytes(&value, sizeof(T));
+        return value;
+    }
+    string get_string()
+    {
+        uint32_t len = get<uint32_t>();
+        if (!good || static_cast<size_t>(end - ptr) < len)
+        {
+            good = false;
+            return string();
+        }
+        string ans(ptr, len);
+        ptr += len;
+        return ans;
+    }
+    void get_bytes(void* out, size_t size)
+    {
+        if (!good || static_cast<size_t>(end - ptr) < size)
+        {
+            good = false;
+            return;
+        }
+        memcpy(out, ptr, size);
+        ptr += size;
+    }
+    bool ok() const
+    {
+        return good;
+    }
+
+  private:
+    const char* ptr;
+    const char* end;
+    bool good;
+};
+
+/*! \brief Decode the body of a cache file
+ * \param   source Full path of the TMX file
+ * \param   in The file contents
+ * \param   map Filled in on success
+ * \returns true if the file was valid and up to date
+ */
+static bool read_map_cache(const string& source, cache_reader& in, tmx_map& map)
+{
+    char magic[sizeof(KQMAP_MAGIC)];
+    in.get_bytes(magic, sizeof(magic));
+    if (!in.ok() || memcmp(magic, KQMAP_MAGIC, sizeof(magic)) != 0 || in.get<uint32_t>() != KQMAP_VERSION ||
+        in.get<uint32_t>() != sizeof(KQEntity))
+    {
+        return false;
+    }
+    uint64_t size;
+    int64_t mtime;
+    if (in.get_string() != source || !file_stamp(source, size, mtime) || in.get<uint64_t>() != size ||
+        in.get<int64_t>() != mtime)
+    {
+        return false;
+    }
+
+    // Properties
+    map.map_no = in.get<int32_t>();
+    map.zero_zone = in.get<uint8_t>() != 0;
+    map.map_mode = in.get<int32_t>();
+    map.can_save = in.get<uint8_t>() != 0;
+    map.tileset = in.get<int32_t>();
+    map.use_sstone = in.get<uint8_t>() != 0;
+    map.can_warp = in.get<uint8_t>() != 0;
+    map.xsize = in.get<int32_t>();
+    map.ysize = in.get<int32_t>();
+    map.pmult = in.get<int32_t>();
+    map.pdiv = in.get<int32_t>();
+    map.stx = in.get<int32_t>();
+    map.sty = in.get<int32_t>();
+    map.warpx = in.get<int32_t>();
+    map.warpy = in.get<int32_t>();
+    map.revision = in.get<int32_t>();
+    map.song_file = in.get_string();
+    map.description = in.get_string();
+    map.primary_tileset_name = in.get_string();
+
+    // Tilesets; external ones must not have changed either
+    uint32_t count = in.get<uint32_t>();
+    for (uint32_t i = 0; i < count && in.ok(); ++i)
+    {
+        KTmxTileset tileset;
+        tileset.source = in.get_string();
+        uint64_t tsx_size = in.get<uint64_t>();
+        int64_t tsx_mtime = in.get<int64_t>();
+        if (!tileset.source.empty() &&
+            (!file_stamp(kqres(MAP_DIR, tileset.source), size, mtime) || size != tsx_size || mtime != tsx_mtime))
+        {
+            return false;
+        }
+        uint32_t firstgid = in.get<uint32_t>();
+        if (!tileset.source.empty())
+        {
+            tileset = TiledMap.load_tsx(tileset.source);
+            tileset.firstgid = firstgid;
+            map.tilesets.push_back(tileset);
+            continue;
+        }
+        tileset.firstgid = firstgid;
+        tileset.name = in.get_string();
+        tileset.sourceimage = in.get_string();
+        tileset.width = in.get<int32_t>();
+        tileset.height = in.get<int32_t>();
+        uint32_t anims = in.get<uint32_t>();
+        for (uint32_t a = 0; a < anims && in.ok(); ++a)
+        {
+            KTmxAnimation anim;
+            anim.tilenumber = in.get<int32_t>();
+            uint32_t frames = in.get<uint32_t>();
+            for (uint32_t f = 0; f < frames && in.ok(); ++f)
+            {
+                KTmxAnimation::animation_frame frame;
+                frame.tile = in.get<int32_t>();
+                frame.delay = in.get<int32_t>();
+                anim.frames.push_back(frame);
+            }
+            tileset.animations.push_back(anim);
+        }
+        map.tilesets.push_back(tileset);
+    }
+
+    // Bounds
+    count = in.get<uint32_t>();
+    for (uint32_t i = 0; i < count && in.ok(); ++i)
+    {
+        KBound bound;
+        bound.left = in.get<int32_t>();
+        bound.top = in.get<int32_t>();
+        bound.right = in.get<int32_t>();
+        bound.bottom = in.get<int32_t>();
+        bound.btile = in.get<int16_t>();
+        map.bounds.Add(bound);
+    }
+
+    // Markers
+    count = in.get<uint32_t>();
+    for (uint32_t i = 0; i < count && in.ok(); ++i)
+    {
+        auto marker = std::make_shared<KMarker>();
+        marker->name = in.get_string();
+        marker->x = in.get<int32_t>();
+        marker->y = in.get<int32_t>();
+        map.markers.Add(marker);
+    }
+
+    // Zones
+    count = in.get<uint32_t>();
+    for (uint32_t i = 0; i < count && in.ok(); ++i)
+    {
+        KZone zone;
+        zone.x = in.get<int32_t>();
+        zone.y = in.get<int32_t>();
+        zone.w = in.get<int32_t>();
+        zone.h = in.get<int32_t>();
+        zone.n = in.get<int32_t>();
+        map.zones.push_back(zone);
+    }
+
+    // Entities are plain data, stored as they are
+    count = in.get<uint32_t>();
+    if (in.ok() && count <= MAX_ENTITIES)
+    {
+        map.entities.resize(count);
+        in.get_bytes(map.entities.data(), count * sizeof(KQEntity));
+    }
+    else
+    {
+        return false;
+    }
+
+    // Layers
+    count = in.get<uint32_t>();
+    for (uint32_t i = 0; i < count && in.ok(); ++i)
+    {
+        string name = in.get_string();
+        int32_t width = in.get<int32_t>();
+        int32_t height = in.get<int32_t>();
+        if (!in.ok() || width < 0 || height < 0 || width != map.xsize || height != map.ysize)
+        {
+            return false;
+        }
+        tmx_layer layer(width, height);
+        layer.name = name;
+        in.get_bytes(layer.data.get(), layer.size * sizeof(uint32_t));
+        map.layers.push_back(std::move(layer));
+    }
+    if (!in.ok())
+    {
+        return false;
+    }
+
+    for (auto& tileset : map.tilesets)
+    {
+        if (tileset.source.empty())
+        {
+            tileset.imagedata = TiledMap.tileset_image(tileset.sourceimage);
+        }
+    }
+    return true;
+}
+
+bool load_map_cache(const string& source, tmx_map& map)
+{
+    const string path = cache_path(source);
+    bool loaded = false;
+#ifdef _WIN32
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    cache_reader in(data.data(), data.size());
+    loaded = read_map_cache(source, in, map);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            cache_reader in(static_cast<const char*>(data), st.st_size);
+            loaded = read_map_cache(source, in, map);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+#endif
+    if (!loaded)
+    {
+        // Don't leave a half-filled map behind
+        map = tmx_map();
+    }
+    return loaded;
+}
+
+void save_map_cache(const string& source, const tmx_map& map)
+{
+    uint64_t size;
+    int64_t mtime;
+    if (!file_stamp(source, size, mtime))
+    {
+        return;
+    }
+
+    cache_writer out;
+    out.put_bytes(KQMAP_MAGIC, sizeof(KQMAP_MAGIC));
+    out.put(KQMAP_VERSION);
+    out.put(static_cast<uint32_t>(sizeof(KQEntity)));
+    out.put_string(source);
+    out.put(size);
+    out.put(mtime);
+
+    // Properties
+    out.put(static_cast<int32_t>(map.map_no));
+    out.put(static_cast<uint8_t>(map.zero_zone));
+    out.put(static_cast<int32_t>(map.map_mode));
+    out.put(static_cast<uint8_t>(map.can_save));
+    out.put(static_cast<int32_t>(map.tileset));
+    out.put(static_cast<uint8_t>(map.use_sstone));
+    out.put(static_cast<uint8_t>(map.can_warp));
+    out.put(static_cast<int32_t>(map.xsize));
+    out.put(static_cast<int32_t>(map.ysize));
+    out.put(static_cast<int32_t>(map.pmult));
+    out.put(static_cast<int32_t>(map.pdiv));
+    out.put(static_cast<int32_t>(map.stx));
+    out.put(static_cast<int32_t>(map.sty));
+    out.put(static_cast<int32_t>(map.warpx));
+    out.put(static_cast<int32_t>(map.warpy));
+    out.put(static_cast<int32_t>(map.revision));
+    out.put_string(map.song_file);
+    out.put_string(map.description);
+    out.put_string(map.primary_tileset_name);
+
+    // Tilesets
+    out.put(static_cast<uint32_t>(map.tilesets.size()));
+    for (auto& tileset : map.tilesets)
+    {
+        uint64_t tsx_size = 0;
+        int64_t tsx_mtime = 0;
+        if (!tileset.source.empty() && !file_stamp(kqres(MAP_DIR, tileset.source), tsx_size, tsx_mtime))
+        {
+            return;
+        }
+        out.put_string(tileset.source);
+        out.put(tsx_size);
+        out.put(tsx_mtime);
+        out.put(static_cast<uint32_t>(tileset.firstgid));
+        if (!tileset.source.empty())
+        {
+            continue;
+        }
+        out.put_string(tileset.name);
+        out.put_string(tileset.sourceimage);
+        out.put(static_cast<int32_t>(tileset.width));
+        out.put(static_cast<int32_t>(tileset.height));
+        out.put(static_cast<uint32_t>(tileset.animations.size()));
+        for (auto& anim : tileset.animations)
+        {
+            out.put(static_cast<int32_t>(anim.tilenumber));
+            out.put(static_cast<uint32_t>(anim.frames.size()));
+            for (auto& frame : anim.frames)
+            {
+                out.put(static_cast<int32_t>(frame.tile));
+                out.put(static_cast<int32_t>(frame.delay));
+            }
+        }
+    }
+
+    // Bounds
+    out.put(static_cast<uint32_t>(map.bounds.Size()));
+    for (size_t i = 0; i < map.bounds.Size(); ++i)
+    {
+        auto bound = map.bounds.GetBound(i);
+        out.put(static_cast<int32_t>(bound->left));
+        out.put(static_cast<int32_t>(bound->top));
+        out.put(static_cast<int32_t>(bound->right));
+        out.put(static_cast<int32_t>(bound->bottom));
+        out.put(static_cast<int16_t>(bound->btile));
+    }
+
+    // Markers
+    out.put(static_cast<uint32_t>(map.markers.Size()));
+    for (size_t i = 0; i < map.markers.Size(); ++i)
+    {
+        auto marker = map.markers.GetMarker(i);
+        out.put_string(marker->name);
+        out.put(static_cast<int32_t>(marker->x));
+        out.put(static_cast<int32_t>(marker->y));
+    }
+
+    // Zones
+    out.put(static_cast<uint32_t>(map.zones.size()));
+    for (auto& zone : map.zones)
+    {
+        out.put(static_cast<int32_t>(zone.x));
+        out.put(static_cast<int32_t>(zone.y));
+        out.put(static_cast<int32_t>(zone.w));
+        out.put(static_cast<int32_t>(zone.h));
+        out.put(static_cast<int32_t>(zone.n));
+    }
+
+    // Entities
+    out.put(static_cast<uint32_t>(map.entities.size()));
+    out.put_bytes(map.entities.data(), map.entities.size() * sizeof(KQEntity));
+
+    // Layers
+    out.put(static_cast<uint32_t>(map.layers.size()));
+    for (auto& layer : map.layers)
+    {
+        out.put_string(layer.name);
+        out.put(static_cast<int32_t>(layer.width));
+        out.put(static_cast<int32_t>(layer.height));
+        out.put_bytes(layer.data.get(), layer.size * sizeof(uint32_t));
+    }
+
+    // Write to a temporary file first so a crash can't leave a truncated cache
+    const string path = cache_path(source);
+    const string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+    {
+        return;
+    }
+    bool written = fwrite(out.buffer.data(), 1, out.buffer.size(), fp) == out.buffer.size();
+    written = (fclose(fp) == 0) && written;
+#ifdef _WIN32
+    // rename() won't replace an existing file here
+    remove(path.c_str());
+#endif
+    if (!written || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        remove(tmp.c_str());
+    }
+}
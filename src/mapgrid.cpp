@@ -0,0 +1,382 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*! \file
+ * \brief Storage for the layers of the current map
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include "mapgrid.h"
+
+KMapGrid MapGrid;
+
+/*! Last obstacle version handed out; shared by all grids, which may be built on other threads */
+static std::atomic<uint32_t> last_obstacle_version(0);
+
+/*! \brief Store a value in one field of a cell */
+static void store(KMapCell& cell, eMapLayer layer, int value)
+{
+    switch (layer)
+    {
+    case MAP_LAYER_BTILE:
+        cell.btile = static_cast<uint16_t>(value);
+        break;
+    case MAP_LAYER_MTILE:
+        cell.mtile = static_cast<uint16_t>(value);
+        break;
+    case MAP_LAYER_FTILE:
+        cell.ftile = static_cast<uint16_t>(value);
+        break;
+    case MAP_LAYER_ZONE:
+        cell.zone = static_cast<uint8_t>(value);
+        break;
+    case MAP_LAYER_SHADOW:
+        cell.shadow = static_cast<uint8_t>(value);
+        break;
+    case MAP_LAYER_OBSTACLE:
+        cell.obstacle = static_cast<uint8_t>(value);
+        break;
+    default:
+        break;
+    }
+}
+
+void KMapGrid::Resize(size_t width, size_t height)
+{
+    m_width = width;
+    m_height = height;
+    m_pages.clear();
+    for (size_t top = 0; top < height; top += MAP_PAGE_ROWS)
+    {
+        const size_t count = width * std::min<size_t>(MAP_PAGE_ROWS, height - top);
+        auto page = std::make_shared<s_page>();
+        page->cells.assign(count, KMapCell());
+        for (auto& tiles : page->tiles)
+        {
+            tiles.assign(count, 0);
+        }
+        for (auto& attributes : page->attributes)
+        {
+            attributes.assign(count, 0);
+        }
+        m_pages.push_back(std::move(page));
+    }
+    ObstaclesChanged();
+}
+
+void KMapGrid::Clear()
+{
+    m_width = m_height = 0;
+    m_pages.clear();
+    ObstaclesChanged();
+}
+
+int KMapGrid::GetAt(eMapLayer layer, int x, int y) const
+{
+    if (!InBounds(x, y))
+    {
+        return 0;
+    }
+    if (layer < NUM_TILE_LAYERS)
+    {
+        return TileRow(layer, y)[x];
+    }
+    return AttributeRow(layer, y)[x];
+}
+
+void KMapGrid::Set(eMapLayer layer, int x, int y, int value)
+{
+    assert(InBounds(x, y));
+    s_page& page = WritablePage(y);
+    const size_t offset = Offset(x, y);
+    if (layer < NUM_TILE_LAYERS)
+    {
+        page.tiles[layer][offset] = static_cast<uint16_t>(value);
+    }
+    else
+    {
+        page.attributes[layer - NUM_TILE_LAYERS][offset] = static_cast<uint8_t>(value);
+    }
+    store(page.cells[offset], layer, value);
+    if (layer == MAP_LAYER_OBSTACLE)
+    {
+        ObstaclesChanged();
+    }
+}
+
+bool KMapGrid::SetAt(eMapLayer layer, int x, int y, int value)
+{
+    if (!InBounds(x, y))
+    {
+        return false;
+    }
+    Set(layer, x, y, value);
+    return true;
+}
+
+void KMapGrid::Fill(eMapLayer layer, int x, int y, int w, int h, int value)
+{
+    const int x1 = std::max(x, 0);
+    const int y1 = std::max(y, 0);
+    const int x2 = std::min<long>(static_cast<long>(x) + w, static_cast<long>(m_width));
+    const int y2 = std::min<long>(static_cast<long>(y) + h, static_cast<long>(m_height));
+    if (x1 >= x2 || y1 >= y2)
+    {
+        return;
+    }
+    const size_t count = x2 - x1;
+    for (int row = y1; row < y2; ++row)
+    {
+        s_page& page = WritablePage(row);
+        const size_t first = Offset(x1, row);
+        if (layer < NUM_TILE_LAYERS)
+        {
+            std::fill_n(page.tiles[layer].begin() + first, count, static_cast<uint16_t>(value));
+        }
+        else
+        {
+            std::fill_n(page.attributes[layer - NUM_TILE_LAYERS].begin() + first, count, static_cast<uint8_t>(value));
+        }
+        SyncCells(page, layer, first, count);
+    }
+    if (layer == MAP_LAYER_OBSTACLE)
+    {
+        ObstaclesChanged();
+    }
+}
+
+void KMapGrid::Copy(int sx, int sy, int dx, int dy, int w, int h, unsigned int layers)
+{
+    // Clip as blit() does: trim both rectangles by whatever falls off either
+    if (sx < 0)
+    {
+        w += sx;
+        dx -= sx;
+        sx = 0;
+    }
+    if (sy < 0)
+    {
+        h += sy;
+        dy -= sy;
+        sy = 0;
+    }
+    if (dx < 0)
+    {
+        w += dx;
+        sx -= dx;
+        dx = 0;
+    }
+    if (dy < 0)
+    {
+        h += dy;
+        sy -= dy;
+        dy = 0;
+    }
+    w = std::min<long>(w, static_cast<long>(m_width) - std::max(sx, dx));
+    h = std::min<long>(h, static_cast<long>(m_height) - std::max(sy, dy));
+    layers &= ALL_MAP_LAYERS;
+    if (w <= 0 || h <= 0 || layers == 0)
+    {
+        return;
+    }
+    if (layers & (1u << MAP_LAYER_OBSTACLE))
+    {
+        ObstaclesChanged();
+    }
+
+    // Walk the rows backwards when moving down so overlapping rows are read before being overwritten
+    const int step = dy > sy ? -1 : 1;
+    const int first_row = step > 0 ? 0 : h - 1;
+    for (int row = first_row; row >= 0 && row < h; row += step)
+    {
+        // Get the destination first: if it is the same page as the source
+        // and gets copied, the source must be read from the new copy
+        s_page& to_page = WritablePage(dy + row);
+        const s_page& from_page = Page(sy + row);
+        const size_t to = Offset(dx, dy + row);
+        const size_t from = Offset(sx, sy + row);
+        for (int layer = 0; layer < NUM_MAP_LAYERS; ++layer)
+        {
+            if (!(layers & (1u << layer)))
+            {
+                continue;
+            }
+            if (layer < NUM_TILE_LAYERS)
+            {
+                memmove(&to_page.tiles[layer][to], &from_page.tiles[layer][from], w * sizeof(uint16_t));
+            }
+            else
+            {
+                memmove(&to_page.attributes[layer - NUM_TILE_LAYERS][to],
+                        &from_page.attributes[layer - NUM_TILE_LAYERS][from], w * sizeof(uint8_t));
+            }
+        }
+        if (layers == ALL_MAP_LAYERS)
+        {
+            memmove(&to_page.cells[to], &from_page.cells[from], w * sizeof(KMapCell));
+        }
+        else
+        {
+            for (int layer = 0; layer < NUM_MAP_LAYERS; ++layer)
+            {
+                if (layers & (1u << layer))
+                {
+                    SyncCells(to_page, static_cast<eMapLayer>(layer), to, w);
+                }
+            }
+        }
+    }
+}
+
+void KMapGrid::Paste(eMapLayer layer, int x, int y, int w, int h, const int* values)
+{
+    const int x1 = std::max(x, 0);
+    const int y1 = std::max(y, 0);
+    const int x2 = std::min<long>(static_cast<long>(x) + w, static_cast<long>(m_width));
+    const int y2 = std::min<long>(static_cast<long>(y) + h, static_cast<long>(m_height));
+    if (x1 >= x2 || y1 >= y2)
+    {
+        return;
+    }
+    const size_t count = x2 - x1;
+    for (int row = y1; row < y2; ++row)
+    {
+        s_page& page = WritablePage(row);
+        const size_t first = Offset(x1, row);
+        const int* from = values + static_cast<size_t>(row - y) * w + (x1 - x);
+        if (layer < NUM_TILE_LAYERS)
+        {
+            std::transform(from, from + count, page.tiles[layer].begin() + first,
+                           [](int v) { return static_cast<uint16_t>(v); });
+        }
+        else
+        {
+            std::transform(from, from + count, page.attributes[layer - NUM_TILE_LAYERS].begin() + first,
+                           [](int v) { return static_cast<uint8_t>(v); });
+        }
+        SyncCells(page, layer, first, count);
+    }
+    if (layer == MAP_LAYER_OBSTACLE)
+    {
+        ObstaclesChanged();
+    }
+}
+
+void KMapGrid::LoadTiles(eMapLayer layer, const uint16_t* data)
+{
+    assert(layer < NUM_TILE_LAYERS);
+    for (size_t top = 0; top < m_height; top += MAP_PAGE_ROWS)
+    {
+        s_page& page = WritablePage(top);
+        std::copy_n(data + top * m_width, page.cells.size(), page.tiles[layer].begin());
+        SyncCells(page, layer, 0, page.cells.size());
+    }
+}
+
+void KMapGrid::LoadAttributes(eMapLayer layer, const uint8_t* data)
+{
+    assert(layer >= NUM_TILE_LAYERS && layer < NUM_MAP_LAYERS);
+    for (size_t top = 0; top < m_height; top += MAP_PAGE_ROWS)
+    {
+        s_page& page = WritablePage(top);
+        std::copy_n(data + top * m_width, page.cells.size(), page.attributes[layer - NUM_TILE_LAYERS].begin());
+        SyncCells(page, layer, 0, page.cells.size());
+    }
+    if (layer == MAP_LAYER_OBSTACLE)
+    {
+        ObstaclesChanged();
+    }
+}
+
+bool KMapGrid::LayerUsed(eMapLayer layer) const
+{
+    for (auto& page : m_pages)
+    {
+        if (layer < NUM_TILE_LAYERS)
+        {
+            auto& tiles = page->tiles[layer];
+            if (std::any_of(tiles.begin(), tiles.end(), [](uint16_t t) { return t != 0; }))
+            {
+                return true;
+            }
+        }
+        else
+        {
+            auto& attributes = page->attributes[layer - NUM_TILE_LAYERS];
+            if (std::any_of(attributes.begin(), attributes.end(), [](uint8_t a) { return a != 0; }))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*! \brief Get a page to change
+ * If any other grid shares the page, this grid gets its own copy first.
+ * \param   y Any row in the page
+ * \returns the page
+ */
+KMapGrid::s_page& KMapGrid::WritablePage(int y)
+{
+    std::shared_ptr<s_page>& page = m_pages[y / MAP_PAGE_ROWS];
+    if (page.use_count() > 1)
+    {
+        page = std::make_shared<s_page>(*page);
+    }
+    return *page;
+}
+
+/*! \brief Copy part of a per-layer array into the interleaved cells
+ * \param   page Page which has changed
+ * \param   layer Layer which has changed
+ * \param   first Offset of the first changed cell in the page
+ * \param   count Number of cells
+ */
+void KMapGrid::SyncCells(s_page& page, eMapLayer layer, size_t first, size_t count)
+{
+    KMapCell* cell = page.cells.data() + first;
+    if (layer < NUM_TILE_LAYERS)
+    {
+        const uint16_t* tiles = page.tiles[layer].data() + first;
+        for (size_t i = 0; i < count; ++i)
+        {
+            store(cell[i], layer, tiles[i]);
+        }
+    }
+    else
+    {
+        const uint8_t* attributes = page.attributes[layer - NUM_TILE_LAYERS].data() + first;
+        for (size_t i = 0; i < count; ++i)
+        {
+            store(cell[i], layer, attributes[i]);
+        }
+    }
+}
+
+/*! \brief Give the obstacle layer a new version, see ObstacleVersion() */
+void KMapGrid::ObstaclesChanged()
+{
+    m_obstacle_version = ++last_obstacle_version;
+}
@@ -0,0 +1,277 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*! \file
+ * \brief Background loading of the maps the player is likely to visit next
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <sys/stat.h>
+
+#include "mappreload.h"
+#include "markers.h"
+#include "platform.h"
+
+using std::string;
+using std::vector;
+
+KMapPreloader MapPreloader;
+
+/*! Most maps to keep ready at once */
+static const size_t MAX_PRELOAD = 6;
+
+/*! Longest map name change_map() accepts */
+static const size_t MAX_MAP_NAME = 15;
+
+static bool is_name_char(char c)
+{
+    return isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+/*! \brief Find the maps a script can change to
+ *
+ * In Lua source this is the first argument of every change_map() call made
+ * with a literal name. Compiled scripts are just searched for names; the
+ * caller throws away any which are not maps.
+ * \param   path Script file
+ * \param   names Names found are added here
+ */
+static void script_targets(const string& path, vector<string>& names)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    const string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const bool source = path.size() > 4 && path.compare(path.size() - 4, 4, ".lua") == 0;
+
+    if (source)
+    {
+        static const char call[] = "change_map";
+        for (size_t at = text.find(call); at != string::npos; at = text.find(call, at + 1))
+        {
+            size_t i = at + sizeof(call) - 1;
+            while (i < text.size() && (isspace(static_cast<unsigned char>(text[i])) || text[i] == '('))
+            {
+                ++i;
+            }
+            if (i >= text.size() || (text[i] != '"' && text[i] != '\''))
+            {
+                continue;
+            }
+            const size_t end = text.find(text[i], i + 1);
+            if (end != string::npos)
+            {
+                names.push_back(text.substr(i + 1, end - i - 1));
+            }
+        }
+    }
+    else
+    {
+        size_t i = 0;
+        while (i < text.size())
+        {
+            size_t end = i;
+            while (end < text.size() && is_name_char(text[end]))
+            {
+                ++end;
+            }
+            if (end > i)
+            {
+                names.push_back(text.substr(i, end - i));
+            }
+            i = end + 1;
+        }
+    }
+}
+
+KMapPreloader::~KMapPreloader()
+{
+    Stop();
+}
+
+void KMapPreloader::Anticipate(const string& current, const string& previous, const KMarkers& markers)
+{
+    vector<string> marker_names;
+    for (size_t i = 0; i < markers.Size(); ++i)
+    {
+        marker_names.push_back(markers.GetMarker(i)->name);
+    }
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_current = current;
+    m_previous = previous;
+    m_markers.swap(marker_names);
+    m_requested = true;
+    ++m_generation;
+    if (!m_thread.joinable())
+    {
+        m_stop = false;
+        m_thread = std::thread(&KMapPreloader::Run, this);
+    }
+    m_changed.notify_all();
+}
+
+bool KMapPreloader::Take(const string& name, tmx_map& map)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_changed.wait(guard, [&] { return m_busy != name; });
+
+    // We're leaving this map, so nothing queued for it is wanted now
+    ++m_generation;
+    m_requested = false;
+    m_wanted.clear();
+    m_queue.clear();
+
+    auto found = m_ready.find(name);
+    if (found == m_ready.end())
+    {
+        return false;
+    }
+    map = std::move(found->second);
+    m_ready.erase(found);
+    return true;
+}
+
+void KMapPreloader::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+        m_changed.notify_all();
+    }
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+    m_wanted.clear();
+    m_queue.clear();
+    m_ready.clear();
+}
+
+/*! \brief The preloader thread */
+void KMapPreloader::Run()
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    for (;;)
+    {
+        m_changed.wait(guard, [this] { return m_stop || m_requested || !m_queue.empty(); });
+        if (m_stop)
+        {
+            return;
+        }
+        if (m_requested)
+        {
+            m_requested = false;
+            const unsigned int generation = m_generation;
+            const string current = m_current;
+            const string previous = m_previous;
+            const vector<string> markers = m_markers;
+
+            guard.unlock();
+            vector<string> wanted = Neighbours(current, previous, markers);
+            guard.lock();
+            if (generation != m_generation)
+            {
+                continue;
+            }
+
+            for (auto it = m_ready.begin(); it != m_ready.end();)
+            {
+                if (std::find(wanted.begin(), wanted.end(), it->first) == wanted.end())
+                {
+                    it = m_ready.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            m_queue.clear();
+            for (auto& name : wanted)
+            {
+                if (m_ready.find(name) == m_ready.end() && name != m_busy)
+                {
+                    m_queue.push_back(name);
+                }
+            }
+            m_wanted.swap(wanted);
+            continue;
+        }
+
+        const string name = m_queue.front();
+        m_queue.pop_front();
+        m_busy = name;
+        guard.unlock();
+        tmx_map map;
+        const bool loaded = TiledMap.preload_tmx(name, map);
+        guard.lock();
+        if (loaded && std::find(m_wanted.begin(), m_wanted.end(), name) != m_wanted.end())
+        {
+            m_ready.emplace(name, std::move(map));
+        }
+        m_busy.clear();
+        m_changed.notify_all();
+    }
+}
+
+/*! \brief Work out which maps to preload
+ *
+ * \param   current Name of the current map
+ * \param   previous Name of the map before it
+ * \param   markers Names of the current map's markers
+ * \returns names of existing maps, most likely first
+ */
+vector<string> KMapPreloader::Neighbours(const string& current, const string& previous,
+                                         const vector<string>& markers) const
+{
+    vector<string> candidates;
+    candidates.push_back(previous);
+    const string script = kqres(SCRIPT_DIR, current);
+    if (!script.empty())
+    {
+        script_targets(script, candidates);
+    }
+    candidates.insert(candidates.end(), markers.begin(), markers.end());
+
+    vector<string> names;
+    std::set<string> seen;
+    for (auto& name : candidates)
+    {
+        if (names.size() >= MAX_PRELOAD)
+        {
+            break;
+        }
+        if (name.empty() || name.size() > MAX_MAP_NAME || name == current || !seen.insert(name).second ||
+            !std::all_of(name.begin(), name.end(), is_name_char))
+        {
+            continue;
+        }
+        struct stat st;
+        if (stat(kqres(MAP_DIR, name + ".tmx").c_str(), &st) == 0)
+        {
+            names.push_back(name);
+        }
+    }
+    return names;
+}
@@ -51,7 +51,13 @@ KMarkers::~KMarkers()
 
 bool KMarkers::Add(shared_ptr<KMarker> marker)
 {
+    if (marker == nullptr)
+    {
+        return false;
+    }
     m_markers.push_back(marker);
+    m_by_name.emplace(marker->name, m_markers.size() - 1);
+    m_by_position.emplace(PositionKey(marker->x, marker->y), m_markers.size() - 1);
     return true;
 }
 
@@ -61,12 +67,13 @@ bool KMarkers::Remove(shared_ptr<KMarker> marker)
     if (found != m_markers.end())
     {
         m_markers.erase(found);
+        Reindex();
         return true;
     }
     return false;
 }
 
-shared_ptr<KMarker> KMarkers::GetMarker(size_t index)
+shared_ptr<KMarker> KMarkers::GetMarker(size_t index) const
 {
     if (index < m_markers.size())
     {
@@ -75,28 +82,51 @@ shared_ptr<KMarker> KMarkers::GetMarker(size_t index)
     return nullptr;
 }
 
-shared_ptr<KMarker> KMarkers::GetMarker(string marker_name)
+shared_ptr<KMarker> KMarkers::GetMarker(const string& marker_name) const
 {
-    for (auto it = m_markers.begin(); it != m_markers.end(); it++)
+    auto found = m_by_name.find(marker_name);
+    if (found != m_by_name.end())
     {
-        if ((*it)->name == marker_name)
-        {
-            return *it;
-        }
+        return m_markers[found->second];
     }
     return nullptr;
 }
 
-shared_ptr<KMarker> KMarkers::GetMarker(int32_t x, int32_t y)
+shared_ptr<KMarker> KMarkers::GetMarker(int32_t x, int32_t y) const
 {
-    for (auto it = m_markers.begin(); it != m_markers.end(); it++)
+    auto found = m_by_position.find(PositionKey(x, y));
+    if (found != m_by_position.end())
     {
-        if ((*it)->x == x && (*it)->y == y)
-        {
-            return *it;
-        }
+        return m_markers[found->second];
     }
     return nullptr;
 }
 
+shared_ptr<KMarker> KMarkers::Move(shared_ptr<KMarker> marker, int32_t x, int32_t y)
+{
+    auto found = std::find(m_markers.begin(), m_markers.end(), marker);
+    if (found == m_markers.end())
+    {
+        return nullptr;
+    }
+    auto moved = std::make_shared<KMarker>(*marker);
+    moved->x = x;
+    moved->y = y;
+    *found = moved;
+    Reindex();
+    return moved;
+}
+
+/*! \brief Rebuild both indexes from the list of markers */
+void KMarkers::Reindex()
+{
+    m_by_name.clear();
+    m_by_position.clear();
+    for (size_t i = 0; i < m_markers.size(); ++i)
+    {
+        m_by_name.emplace(m_markers[i]->name, i);
+        m_by_position.emplace(PositionKey(m_markers[i]->x, m_markers[i]->y), i);
+    }
+}
+
 KMarker Marker;
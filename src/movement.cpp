@@ -31,119 +31,348 @@
 
 #include "movement.h"
 #include "kq.h"
+#include "mapgrid.h"
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <list>
+#include <string>
+#include <vector>
 
-static int compose_path(AL_CONST int*, uint32_t, uint32_t, char*, size_t);
-static void copy_map(int*);
-static int minimize_path(AL_CONST char*, char*, size_t);
-static int search_paths(uint32_t, int*, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t,
-                        uint32_t);
+/*! \brief One entry in the open list of the search */
+struct s_open
+{
+    uint32_t estimate; /*!< Steps so far plus the distance still to go */
+    uint32_t steps;    /*!< Steps from the source */
+    uint32_t index;    /*!< Cell, as y * width + x */
+};
 
-/*! \brief Generates the solution path.
+/*! \brief Order the open list so the smallest estimate is on top
  *
- * The only way of doing this is walking the path backwards, minimizing and
- * turning it the way around.
+ * Ties go to the entry which is furthest along, so the search keeps
+ * heading straight for the target across open ground.
+ */
+static bool open_after(const s_open& a, const s_open& b)
+{
+    if (a.estimate != b.estimate)
+    {
+        return a.estimate > b.estimate;
+    }
+    return a.steps < b.steps;
+}
+
+/*! \brief Search state, kept between calls so nothing is allocated per search
  *
- * \param map [in]      The map with the paths.
- * \param target_x [in] Target x coordinate.
- * \param target_y [in] Target y coordinate.
- * \param buffer [out]  Buffer to store the solution.
- * \param size [in]     Size of the solution buffer.
+ * A cell's entries are only valid when its stamp equals the current
+ * generation, so starting a search is just bumping the generation.
+ */
+static struct
+{
+    std::vector<uint32_t> stamp;    /*!< Generation in which the cell was reached */
+    std::vector<uint32_t> steps;    /*!< Best known steps from the source */
+    std::vector<char> came;         /*!< Direction of the step into the cell */
+    std::vector<uint32_t> occupied; /*!< Generation in which an entity stood here */
+    std::vector<s_open> open;
+    uint32_t generation = 0;
+} search;
+
+/*! \brief The four moves, with the letter used for them in movement scripts */
+static const struct
+{
+    int dx, dy;
+    char letter;
+} directions[] = { { 0, -1, 'U' }, { 0, 1, 'D' }, { -1, 0, 'L' }, { 1, 0, 'R' } };
+
+/*! \brief Which cells can possibly reach each other
  *
- * \returns If the solution was copied.
- *          0 The solution was copied.
- *          1 The buffer was too small for the solution to be copied.
- *          2 There was no solution, or internal error.
+ * Two neighbouring cells are in the same region if a step is allowed
+ * between them in at least one direction; entities are not taken into
+ * account. So if two cells are in different regions there is definitely
+ * no path between them, and find_path() can give up at once.
+ */
+static struct
+{
+    std::vector<uint32_t> label; /*!< Region of each cell, as y * width + x */
+    std::vector<uint32_t> queue; /*!< Cells still to visit while flooding */
+    uint32_t next_label = 1;
+    uint32_t version = 0; /*!< Obstacle version the labels were worked out for */
+} regions;
+
+/*! \brief A path found earlier */
+struct s_cached_path
+{
+    uint32_t source;    /*!< Source cell, as y * width + x */
+    uint32_t target;    /*!< Target cell */
+    uint32_t version;   /*!< Obstacle version of the map */
+    uint32_t occupancy; /*!< Where the other entities were, see occupancy_key() */
+    std::string path;   /*!< The minimized path */
+};
+
+/*! Most paths to remember */
+static const size_t MAX_CACHED_PATHS = 32;
+
+/*! Paths found recently, most recently used first */
+static std::list<s_cached_path> cached_paths;
+
+static int copy_path(const std::string&, char*, size_t);
+static std::string minimize_path(const std::string&);
+
+/*! \brief Check whether a step between two cells is allowed
  *
- * \sa search_paths copy_map find_path minimize_path
+ * Uses the same obstacle rules as obstruction() in entity.cpp: the target
+ * cell must not be fully blocked, and neither cell may block that side.
+ *
+ * \param from [in] The cell being left.
+ * \param to [in]   The cell being entered.
+ * \param dx [in]   Horizontal step, -1, 0 or 1.
+ * \param dy [in]   Vertical step, -1, 0 or 1.
+ *
+ * \returns true if the step is blocked.
  */
-static int compose_path(AL_CONST int* map, uint32_t target_x, uint32_t target_y, char* buffer, size_t size)
+static bool step_blocked(const KMapCell& from, const KMapCell& to, int dx, int dy)
 {
-    char temp[1024];
-    int index = 0;
-    uint32_t x;
-    uint32_t y;
-    int value;
-
-    x = target_x;
-    y = target_y;
-    value = map[y * g_map.xsize + x];
-    index = value - 2;
-    memset(temp, '\0', sizeof(temp));
-
-    while (value > 1)
+    if (to.obstacle == BLOCK_ALL)
     {
-        /*  move as many squares up as possible  */
-        while ((y > 0) && (map[(y - 1) * g_map.xsize + x] == (value - 1)) && (value > 1))
-        {
-            value--;
-            y--;
-            temp[index--] = 'D';
-        }
+        return true;
+    }
+    if (dy < 0)
+    {
+        return from.obstacle == BLOCK_U || to.obstacle == BLOCK_D;
+    }
+    if (dy > 0)
+    {
+        return from.obstacle == BLOCK_D || to.obstacle == BLOCK_U;
+    }
+    if (dx < 0)
+    {
+        return from.obstacle == BLOCK_L || to.obstacle == BLOCK_R;
+    }
+    return from.obstacle == BLOCK_R || to.obstacle == BLOCK_L;
+}
 
-        /*  move as many squares left as possible  */
-        while ((x > 0) && (map[y * g_map.xsize + (x - 1)] == (value - 1)) && (value > 1))
-        {
-            value--;
-            x--;
-            temp[index--] = 'R';
-        }
+/*! \brief Check whether two neighbouring cells belong to the same region
+ *
+ * \param x [in]  The x coordinate of the first cell.
+ * \param y [in]  The y coordinate of the first cell.
+ * \param dx [in] Horizontal step to the second cell, -1, 0 or 1.
+ * \param dy [in] Vertical step to the second cell, -1, 0 or 1.
+ *
+ * \returns true if the second cell is on the map and a step either way is allowed.
+ */
+static bool linked(int x, int y, int dx, int dy)
+{
+    if (!MapGrid.InBounds(x + dx, y + dy))
+    {
+        return false;
+    }
+    const KMapCell& here = MapGrid.Cell(x, y);
+    const KMapCell& there = MapGrid.Cell(x + dx, y + dy);
+    return !step_blocked(here, there, dx, dy) || !step_blocked(there, here, -dx, -dy);
+}
 
-        /*  move as many squares down as possible  */
-        while ((y < g_map.ysize - 1) && (map[(y + 1) * g_map.xsize + x] == (value - 1)) && (value > 1))
+/*! \brief Give a new label to a cell and every cell linked to it
+ *
+ * Cells which already have a label of \p first or above are left alone,
+ * so several floods can share a pass.
+ *
+ * \param start [in] The cell to start from, as y * width + x.
+ * \param first [in] The first label handed out in this pass.
+ */
+static void flood_region(uint32_t start, uint32_t first)
+{
+    const uint32_t width = MapGrid.Width();
+    const uint32_t label = regions.next_label++;
+
+    regions.queue.clear();
+    regions.queue.push_back(start);
+    regions.label[start] = label;
+    while (!regions.queue.empty())
+    {
+        const uint32_t index = regions.queue.back();
+        regions.queue.pop_back();
+        const int x = index % width;
+        const int y = index / width;
+        for (auto& direction : directions)
         {
-            value--;
-            y++;
-            temp[index--] = 'U';
+            const uint32_t next = (y + direction.dy) * width + (x + direction.dx);
+            if (linked(x, y, direction.dx, direction.dy) && regions.label[next] < first)
+            {
+                regions.label[next] = label;
+                regions.queue.push_back(next);
+            }
         }
+    }
+}
 
-        /*  move as many squares right as possible  */
-        while ((x < g_map.xsize - 1) && (map[y * g_map.xsize + (x + 1)] == (value - 1)) && (value > 1))
+/*! \brief Work out the regions of the current map, if the obstacles have changed
+ *
+ * \sa set_obstacle find_path
+ */
+void update_regions(void)
+{
+    if (regions_current())
+    {
+        return;
+    }
+
+    regions.label.assign(MapGrid.Width() * MapGrid.Height(), 0);
+    regions.next_label = 1;
+    for (uint32_t index = 0; index < regions.label.size(); index++)
+    {
+        if (regions.label[index] == 0)
         {
-            value--;
-            x++;
-            temp[index--] = 'L';
+            flood_region(index, 1);
         }
     }
+    regions.version = MapGrid.ObstacleVersion();
+}
 
-    return (minimize_path(temp, buffer, size));
+/*! \brief Whether the regions match the obstacles on the map now
+ *
+ * Check this before changing a block of obstacles; if it was true, pass
+ * the block to update_regions(int, int, int, int) afterwards.
+ */
+bool regions_current(void)
+{
+    return regions.version == MapGrid.ObstacleVersion() && regions.label.size() == MapGrid.Width() * MapGrid.Height();
 }
 
-/*! \brief Generates an internal map.
+/*! \brief Work out the regions again after the obstacles in a rectangle changed
  *
- * The function generates a map setting to -1 any square that is blocked
- * by either an object or an entity.
+ * Only the regions which cells in the rectangle, or next to it, were in
+ * can have split or joined, so only those are flooded again. The regions
+ * must have been current before the change; otherwise they are just
+ * worked out in full when next needed.
  *
- * \param map [out] The map where the result will be copied
+ * \param x [in] The left edge of the rectangle.
+ * \param y [in] The top edge of the rectangle.
+ * \param w [in] The width of the rectangle.
+ * \param h [in] The height of the rectangle.
  *
- * \sa search_paths compose_path find_path minimize_path
+ * \sa regions_current
  */
-static void copy_map(int* map)
+void update_regions(int x, int y, int w, int h)
 {
-    size_t x, y;
-    size_t index, entity_index;
+    // Include the cells next to the rectangle, but not the corners: only
+    // their diagonal links touch it, and those are not steps
+    const int x1 = std::max(x - 1, 0);
+    const int y1 = std::max(y - 1, 0);
+    const int x2 = std::min<long>(static_cast<long>(x) + w + 1, static_cast<long>(MapGrid.Width()));
+    const int y2 = std::min<long>(static_cast<long>(y) + h + 1, static_cast<long>(MapGrid.Height()));
+    if (x1 >= x2 || y1 >= y2)
+    {
+        return;
+    }
+    if (regions.next_label > UINT32_MAX - static_cast<uint32_t>(x2 - x1) * (y2 - y1))
+    {
+        regions.version = 0;
+        update_regions();
+        return;
+    }
 
-    for (y = 0; y < g_map.ysize; y++)
+    const uint32_t width = MapGrid.Width();
+    const uint32_t first = regions.next_label;
+    for (int cy = y1; cy < y2; ++cy)
     {
-        for (x = 0; x < g_map.xsize; x++)
+        for (int cx = x1; cx < x2; ++cx)
         {
-            index = y * g_map.xsize + x;
-
-            if (o_seg[index] != BLOCK_NONE)
+            const bool outside_x = cx < x || cx >= x + w;
+            const bool outside_y = cy < y || cy >= y + h;
+            const uint32_t index = cy * width + cx;
+            if (!(outside_x && outside_y) && regions.label[index] < first)
             {
-                map[index] = -1;
+                flood_region(index, first);
             }
         }
     }
+    regions.version = MapGrid.ObstacleVersion();
+}
+
+/*! \brief Change the obstacle of one cell
+ *
+ * Only the regions around the cell are worked out again, rather than the
+ * whole map.
+ *
+ * \param x [in]     The x coordinate of the cell.
+ * \param y [in]     The y coordinate of the cell.
+ * \param value [in] The new obstacle, one of the BLOCK_* values.
+ *
+ * \returns false if the cell is off the map.
+ *
+ * \sa update_regions
+ */
+bool set_obstacle(int x, int y, int value)
+{
+    if (!MapGrid.InBounds(x, y))
+    {
+        return false;
+    }
+    if (MapGrid.Cell(x, y).obstacle == value)
+    {
+        return true;
+    }
+
+    const bool current = regions_current();
+    MapGrid.Set(MAP_LAYER_OBSTACLE, x, y, value);
+    if (current)
+    {
+        update_regions(x, y, 1, 1);
+    }
+    return true;
+}
+
+/*! \brief Sum up where the entities other than the moving one are
+ *
+ * \param entity_id [in] The ID of the entity moving around.
+ *
+ * \returns a hash of the positions of the other active entities.
+ */
+static uint32_t occupancy_key(size_t entity_id)
+{
+    uint32_t key = 2166136261u;
+    for (t_entity entity_index : active_entities())
+    {
+        const KQEntity& ent = g_ent[entity_index];
+        if (entity_index != entity_id)
+        {
+            key = (key ^ (uint32_t)(ent.tiley * g_map.xsize + ent.tilex)) * 16777619u;
+        }
+    }
+    return key;
+}
+
+/*! \brief Get the search state ready for a new search
+ *
+ * Grows the arrays if the map is bigger than any searched before, starts
+ * a new generation and marks the cells where other entities stand.
+ *
+ * \param entity_id [in] The ID of the entity moving around; it does not block itself.
+ * \param cells [in]     Number of cells in the map.
+ */
+static void start_search(size_t entity_id, size_t cells)
+{
+    if (search.stamp.size() < cells)
+    {
+        search.stamp.resize(cells, 0);
+        search.steps.resize(cells, 0);
+        search.came.resize(cells, 0);
+        search.occupied.resize(cells, 0);
+    }
+    if (++search.generation == 0)
+    {
+        // Wrapped around: old stamps could look current, so wipe them
+        std::fill(search.stamp.begin(), search.stamp.end(), 0);
+        std::fill(search.occupied.begin(), search.occupied.end(), 0);
+        search.generation = 1;
+    }
+    search.open.clear();
 
-    /*  RB: faster to do this than to check if there is an entity at every square
-     */
-    for (entity_index = 0; entity_index < MAX_ENTITIES; entity_index++)
+    for (t_entity entity_index : active_entities())
     {
-        if (g_ent[entity_index].active)
+        const KQEntity& ent = g_ent[entity_index];
+        if (entity_index != entity_id && MapGrid.InBounds(ent.tilex, ent.tiley))
         {
-            map[g_ent[entity_index].tilex * g_map.ysize + g_ent[entity_index].tiley] = -1;
+            search.occupied[ent.tiley * g_map.xsize + ent.tilex] = search.generation;
         }
     }
 }
@@ -153,6 +382,14 @@ static void copy_map(int* map)
  * Call this function to calculate the shortest path between a given
  * NPC and a target point.
  *
+ * This is an A* search over the map cells, using the Manhattan distance to
+ * the target as the estimate. Cells are blocked by obstacles (taking the
+ * direction of the step into account) and by other active entities.
+ *
+ * Targets outside the source's region are turned down without searching,
+ * and the last few paths found are remembered for as long as the obstacles
+ * and the other entities stay where they are.
+ *
  * \param entity_id [in] The ID of the entity moving around.
  * \param source_x [in]  The x coordinate of the source point.
  * \param source_y [in]  The y coordinate of the source point.
@@ -167,14 +404,11 @@ static void copy_map(int* map)
  *          2 Path found but result buffer too small to hold the answer.
  *          3 Misc error.
  *
- * \sa copy_map compose_path search_paths minimize_path
+ * \sa update_regions minimize_path
  */
 int find_path(size_t entity_id, uint32_t source_x, uint32_t source_y, uint32_t target_x, uint32_t target_y,
               char* buffer, uint32_t size)
 {
-    int* map = NULL;
-    uint32_t result = 0;
-
     if (buffer == NULL || size == 0)
     {
         return 3;
@@ -182,29 +416,122 @@ int find_path(size_t entity_id, uint32_t source_x, uint32_t source_y, uint32_t t
 
     memset(buffer, '\0', size);
 
-    /*  TODO: Allocate memory once instead of every call  */
-    result = g_map.xsize * g_map.ysize * sizeof(int);
-    map = (int*)malloc(result);
-    if (map == NULL)
+    const uint32_t width = g_map.xsize;
+    if (width != MapGrid.Width() || g_map.ysize != MapGrid.Height() || !MapGrid.InBounds(source_x, source_y))
     {
         return 3;
     }
+    if (!MapGrid.InBounds(target_x, target_y))
+    {
+        return 1;
+    }
 
-    memset(map, 0, result);
-    copy_map(map);
-    result = search_paths(entity_id, map, 1, source_x, source_y, target_x, target_y, 0, 0, g_map.xsize, g_map.ysize);
+    const uint32_t source = source_y * width + source_x;
+    const uint32_t target = target_y * width + target_x;
 
-    if (result == 0)
+    update_regions();
+    if (regions.label[source] != regions.label[target])
     {
-        result = compose_path(map, target_x, target_y, buffer, size);
+        return 1;
     }
-    else
+
+    const uint32_t occupancy = occupancy_key(entity_id);
+    for (auto it = cached_paths.begin(); it != cached_paths.end(); ++it)
     {
-        result = 1;
+        if (it->source == source && it->target == target && it->version == regions.version &&
+            it->occupancy == occupancy)
+        {
+            cached_paths.splice(cached_paths.begin(), cached_paths, it);
+            return copy_path(it->path, buffer, size);
+        }
     }
 
-    free(map);
-    return result;
+    start_search(entity_id, MapGrid.Width() * MapGrid.Height());
+
+    search.stamp[source] = search.generation;
+    search.steps[source] = 0;
+    search.came[source] = 0;
+    const uint32_t distance = abs((int)target_x - (int)source_x) + abs((int)target_y - (int)source_y);
+    search.open.push_back({ distance, 0, source });
+
+    bool found = false;
+    while (!search.open.empty())
+    {
+        std::pop_heap(search.open.begin(), search.open.end(), open_after);
+        const s_open current = search.open.back();
+        search.open.pop_back();
+
+        if (current.index == target)
+        {
+            found = true;
+            break;
+        }
+        // A shorter way here was found after this entry was added
+        if (current.steps != search.steps[current.index])
+        {
+            continue;
+        }
+
+        const int x = current.index % width;
+        const int y = current.index / width;
+        const KMapCell& here = MapGrid.Cell(x, y);
+        for (auto& direction : directions)
+        {
+            const int next_x = x + direction.dx;
+            const int next_y = y + direction.dy;
+            if (!MapGrid.InBounds(next_x, next_y))
+            {
+                continue;
+            }
+            const uint32_t next = next_y * width + next_x;
+            const uint32_t steps = current.steps + 1;
+            if (search.stamp[next] == search.generation && search.steps[next] <= steps)
+            {
+                continue;
+            }
+            if (search.occupied[next] == search.generation ||
+                step_blocked(here, MapGrid.Cell(next_x, next_y), direction.dx, direction.dy))
+            {
+                continue;
+            }
+
+            search.stamp[next] = search.generation;
+            search.steps[next] = steps;
+            search.came[next] = direction.letter;
+            const uint32_t remaining = abs((int)target_x - next_x) + abs((int)target_y - next_y);
+            search.open.push_back({ steps + remaining, steps, next });
+            std::push_heap(search.open.begin(), search.open.end(), open_after);
+        }
+    }
+
+    if (!found)
+    {
+        return 1;
+    }
+
+    // Walk back from the target, then turn the moves the right way around
+    std::string path;
+    for (uint32_t index = target; index != source;)
+    {
+        const char letter = search.came[index];
+        path += letter;
+        for (auto& direction : directions)
+        {
+            if (direction.letter == letter)
+            {
+                index -= direction.dy * (int)width + direction.dx;
+                break;
+            }
+        }
+    }
+    std::reverse(path.begin(), path.end());
+
+    cached_paths.push_front({ source, target, regions.version, occupancy, minimize_path(path) });
+    if (cached_paths.size() > MAX_CACHED_PATHS)
+    {
+        cached_paths.pop_back();
+    }
+    return copy_path(cached_paths.front().path, buffer, size);
 }
 
 /*! \brief Minimizes a path.
@@ -212,116 +539,52 @@ int find_path(size_t entity_id, uint32_t source_x, uint32_t source_y, uint32_t t
  * Given a path like "RRRRDRRDLU", this functions generates "R4D1R2D1L1U1".
  *
  * \param source [in] The original string.
- * \param target [out]The buffer where the result will be stored.
- * \param size   [in] The result buffer size.
  *
- * \returns 0 if the solution was copied,
- *          1 if the buffer was too small for the solution to be copied.
+ * \returns the minimized path.
  *
- * \sa search_paths copy_map find_path compose_path
+ * \sa find_path
  */
-static int minimize_path(AL_CONST char* source, char* target, size_t size)
+static std::string minimize_path(const std::string& source)
 {
-    size_t source_index = 0;
-    uint32_t repetition = 0;
-    char value;
+    std::string buffer;
     char temp[16];
-    char buffer[512];
 
-    memset(buffer, '\0', sizeof(buffer));
-    while (source[source_index] != '\0')
+    for (size_t source_index = 0; source_index < source.size();)
     {
-        value = source[source_index];
-
-        source_index++;
-        repetition = 1;
-        while ((source[source_index] == value) && (source[source_index] != '\0'))
+        const char value = source[source_index];
+        uint32_t repetition = 0;
+        while (source_index < source.size() && source[source_index] == value)
         {
             source_index++;
             repetition++;
         }
 
-        /*  FIXME: check to see if the buffer is long enough?  */
         snprintf(temp, sizeof(temp), "%c%u", value, repetition);
-        strncat(buffer, temp, sizeof(buffer) - strlen(buffer) - 1);
-    }
-
-    if (strlen(buffer) < size)
-    {
-        strcpy(target, buffer);
-        return 0;
-    }
-    else
-    {
-        return 1;
+        buffer += temp;
     }
+    return buffer;
 }
 
-/*! \brief Internal path search routine.
- *
- * This function uses recursivity to find the shortest path to the target
- * point. Once it returns 0, a path was successfully found.
+/*! \brief Copies a minimized path to the caller's buffer.
  *
- * \param entity_id [in]     The ID of the entity moving around.
- * \param map [in,out] The map in where to write the paths.
- * \param step [in]    The current step in recursivity.
- * \param source_x [in] The x coordinate of the source point.
- * \param source_y [in] The y coordinate of the source point.
- * \param target_x [in] The x coordinate of the target point.
- * \param target_y [in] The y coordinate of the target point.
- * \param start_x [in] The minimum value of the x axis.
- * \param start_y [in] The minimum value of the y axis.
- * \param limit_x [in] The maximum value of the x axis.
- * \param limit_y [in] The maximum value of the y axis.
+ * \param path [in]   The minimized path.
+ * \param target [out] The buffer where the result will be stored.
+ * \param size [in]   The result buffer size.
  *
- * \returns 0 if a path was successfully found, otherwise non-zero to indicate
- * failure.
+ * \returns 0 if the solution was copied,
+ *          2 if the buffer was too small for the solution to be copied.
  *
- * \sa copy_map compose_path find_path minimize_path
+ * \sa find_path
  */
-static int search_paths(uint32_t entity_id, int* map, uint32_t step, uint32_t source_x, uint32_t source_y,
-                        uint32_t target_x, uint32_t target_y, uint32_t start_x, uint32_t start_y, uint32_t limit_x,
-                        uint32_t limit_y)
+static int copy_path(const std::string& path, char* target, size_t size)
 {
-    int index;
-    int value;
-    int result = 1;
-
-    index = source_y * limit_x + source_x;
-    value = map[index];
-    if ((value != -1) && (value == 0 || value > (int)step) && (step == 1 || !entityat(source_x, source_y, entity_id)))
+    if (path.size() < size)
     {
-        map[index] = step;
-
-        if (source_x == target_x && source_y == target_y)
-        {
-            return 0;
-        }
-
-        if (source_x > start_x)
-        {
-            result &= search_paths(entity_id, map, step + 1, source_x - 1, source_y, target_x, target_y, start_x,
-                                   start_y, limit_x, limit_y);
-        }
-
-        if (source_x < limit_x - 1)
-        {
-            result &= search_paths(entity_id, map, step + 1, source_x + 1, source_y, target_x, target_y, start_x,
-                                   start_y, limit_x, limit_y);
-        }
-
-        if (source_y > start_y)
-        {
-            result &= search_paths(entity_id, map, step + 1, source_x, source_y - 1, target_x, target_y, start_x,
-                                   start_y, limit_x, limit_y);
-        }
-
-        if (source_y < limit_y - 1)
-        {
-            result &= search_paths(entity_id, map, step + 1, source_x, source_y + 1, target_x, target_y, start_x,
-                                   start_y, limit_x, limit_y);
-        }
+        strcpy(target, path.c_str());
+        return 0;
+    }
+    else
+    {
+        return 2;
     }
-
-    return (result);
 }
@@ -0,0 +1,259 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*! \file
+ * \brief Compiled Lua script cache
+ *
+ * Layout of a .kqlua file (host byte order, like the .kqmap files):
+ *
+ * - header: magic, format version, LUA_VERSION_NUM, script path, size, mtime
+ * - the chunk as written by lua_dump()
+ *
+ * lua_undump() checks the chunk against the running Lua as well, so a
+ * cache written by an incompatible build is just rebuilt.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <sys/stat.h>
+
+extern "C" {
+#include <lauxlib.h>
+#include <lua.h>
+}
+
+#include "platform.h"
+#include "scriptcache.h"
+
+using std::string;
+
+static const char KQLUA_MAGIC[8] = { 'K', 'Q', 'L', 'U', 'A', 0, 0, 0 };
+static const uint32_t KQLUA_VERSION = 1;
+
+/*! \brief The cache file header, followed by the path of the script */
+struct s_script_header
+{
+    char magic[sizeof(KQLUA_MAGIC)];
+    uint32_t version;
+    uint32_t lua_version;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t path_length;
+};
+
+/*! \brief Size and modification time of a file
+ * \param   path File to look at
+ * \param   size Set to the file size
+ * \param   mtime Set to the modification time
+ * \returns true if the file exists
+ */
+static bool file_stamp(const string& path, uint64_t& size, int64_t& mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtime);
+    return true;
+}
+
+/*! \brief Read a whole file
+ * \param   path File to read
+ * \param   data Set to the contents
+ * \returns true if the file could be read
+ */
+static bool read_file(const string& path, string& data)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+/*! \brief Where the cache for a script lives
+ * \param   source Full path of the script
+ * \returns path in the cache directory
+ */
+static string cache_path(const string& source)
+{
+    size_t slash = source.find_last_of("/\\");
+    string base = source.substr(slash == string::npos ? 0 : slash + 1);
+    size_t dot = base.rfind('.');
+    if (dot != string::npos)
+    {
+        base.erase(dot);
+    }
+    return kqres(CACHE_DIR, base + ".kqlua");
+}
+
+/*! \brief Header which the cache of a script must have to be used */
+static s_script_header script_header(const string& source, uint64_t size, int64_t mtime)
+{
+    s_script_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KQLUA_MAGIC, sizeof(header.magic));
+    header.version = KQLUA_VERSION;
+    header.lua_version = LUA_VERSION_NUM;
+    header.size = size;
+    header.mtime = mtime;
+    header.path_length = static_cast<uint32_t>(source.size());
+    return header;
+}
+
+/*! \brief lua_Writer which appends to a string */
+static int string_writer(lua_State*, const void* p, size_t sz, void* ud)
+{
+    static_cast<string*>(ud)->append(static_cast<const char*>(p), sz);
+    return 0;
+}
+
+/*! \brief Write the chunk on top of the stack to the cache
+ *
+ * Failures are not fatal; the script will just be compiled again next time.
+ * \param   L The Lua state
+ * \param   source Full path of the script
+ * \param   header Header for the cache file
+ */
+static void save_script_cache(lua_State* L, const string& source, const s_script_header& header)
+{
+    string out(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(source);
+#if LUA_VERSION_NUM >= 503
+    const int dumped = lua_dump(L, string_writer, &out, 0);
+#else
+    const int dumped = lua_dump(L, string_writer, &out);
+#endif
+    if (dumped != 0)
+    {
+        return;
+    }
+
+    // Write to a temporary file first so a crash can't leave a truncated cache
+    const string path = cache_path(source);
+    const string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+    {
+        return;
+    }
+    bool written = fwrite(out.data(), 1, out.size(), fp) == out.size();
+    written = (fclose(fp) == 0) && written;
+#ifdef _WIN32
+    // rename() won't replace an existing file here
+    remove(path.c_str());
+#endif
+    if (!written || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        remove(tmp.c_str());
+    }
+}
+
+int load_cached_script(lua_State* L, const string& source)
+{
+    const bool compiled = source.size() < 4 || source.compare(source.size() - 4, 4, ".lua") != 0;
+    uint64_t size;
+    int64_t mtime;
+    string data;
+
+    if (!file_stamp(source, size, mtime))
+    {
+        lua_pushfstring(L, "cannot open %s", source.c_str());
+        return LUA_ERRFILE;
+    }
+    const s_script_header header = script_header(source, size, mtime);
+    if (!compiled && read_file(cache_path(source), data) && data.size() > sizeof(header) + source.size() &&
+        memcmp(data.data(), &header, sizeof(header)) == 0 && data.compare(sizeof(header), source.size(), source) == 0)
+    {
+        const size_t skip = sizeof(header) + source.size();
+        if (luaL_loadbufferx(L, data.data() + skip, data.size() - skip, source.c_str(), "b") == 0)
+        {
+            return 0;
+        }
+        // Damaged or from an incompatible Lua; fall back to the source
+        lua_pop(L, 1);
+    }
+
+    if (!read_file(source, data))
+    {
+        lua_pushfstring(L, "cannot read %s", source.c_str());
+        return LUA_ERRFILE;
+    }
+    const int ret = luaL_loadbufferx(L, data.data(), data.size(), source.c_str(), NULL);
+    if (ret == 0 && !compiled)
+    {
+        save_script_cache(L, source, header);
+    }
+    return ret;
+}
+
+bool precompile_scripts(void)
+{
+    // The scripts directory lists its scripts in allsc.txt
+    const string global = kqres(SCRIPT_DIR, "global");
+    const size_t slash = global.find_last_of("/\\");
+    std::ifstream list((global.substr(0, slash == string::npos ? 0 : slash + 1) + "allsc.txt").c_str());
+    if (global.empty() || !list)
+    {
+        printf("Can't find the list of scripts\n");
+        return false;
+    }
+
+    lua_State* L = luaL_newstate();
+    if (L == NULL)
+    {
+        return false;
+    }
+    bool ok = true;
+    int count = 0;
+    string name;
+    while (list >> name)
+    {
+        const string source = kqres(SCRIPT_DIR, name);
+        if (source.empty())
+        {
+            printf("%s: not found\n", name.c_str());
+            ok = false;
+            continue;
+        }
+        if (load_cached_script(L, source) != 0)
+        {
+            printf("%s: %s\n", name.c_str(), lua_tostring(L, -1));
+            ok = false;
+        }
+        else
+        {
+            ++count;
+        }
+        lua_pop(L, 1);
+    }
+    lua_close(L);
+    printf("Compiled %d scripts\n", count);
+    return ok;
+}
@@ -431,6 +431,7 @@ static void party_add(ePIDX id, int lead)
         t->eid = (uint8_t)id;
         t->active = 1;
         t->chrx = 0;
+        sync_entities();
     }
 }
 
@@ -475,6 +476,7 @@ static void party_remove(ePIDX id)
             memmove(&g_ent[pidx_index], &g_ent[pidx_index + 1], sizeof(*g_ent) * (numchrs - pidx_index));
             pidx[numchrs] = PIDX_UNDEFINED;
             g_ent[numchrs].active = 0;
+            sync_entities();
             return;
         }
     }
@@ -0,0 +1,206 @@
+/*! \page License
+   KQ is Copyright (C) 2002 by Josh Bolduc
+
+   This file is part of KQ... a freeware RPG.
+
+   KQ is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; either version 2, or (at your
+   option) any later version.
+
+   KQ is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with KQ; see the file COPYING.  If not, write to
+   the Free Software Foundation,
+       675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*! \file
+ * \brief Startup task scheduler
+ *
+ * Runs the independent parts of KGame::startup() (image slicing, save game
+ * headers, enemy data and so on) on a few worker threads while the main
+ * thread deals with Allegro.
+ */
+
+#include "startup.h"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/*! \brief CPU time used so far by the calling thread, in milliseconds
+ *
+ * Falls back to process CPU time where per-thread clocks are unavailable,
+ * in which case the per-phase figures overlap.
+ */
+static double thread_cpu_ms(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    {
+        return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+    }
+#endif
+    return std::clock() * 1000.0 / CLOCKS_PER_SEC;
+}
+
+KStartupTasks::TaskId KStartupTasks::Add(const std::string& name, std::function<void()> fn,
+                                         std::initializer_list<TaskId> deps, bool main_thread)
+{
+    s_task task;
+    task.name = name;
+    task.fn = std::move(fn);
+    task.deps.assign(deps.begin(), deps.end());
+    task.pending = 0;
+    task.main_thread = main_thread;
+    task.ran_on_main = false;
+    task.start_ms = task.wall_ms = task.cpu_ms = 0.0;
+    for (TaskId dep : task.deps)
+    {
+        /* Only earlier phases may be depended upon, so there can be no cycles */
+        assert(dep < m_tasks.size());
+        (void)dep;
+    }
+    m_tasks.push_back(std::move(task));
+    return m_tasks.size() - 1;
+}
+
+void KStartupTasks::Execute(s_task& task, bool on_main)
+{
+    using namespace std::chrono;
+    const double cpu0 = thread_cpu_ms();
+    const steady_clock::time_point t0 = steady_clock::now();
+    task.fn();
+    const steady_clock::time_point t1 = steady_clock::now();
+    task.cpu_ms = thread_cpu_ms() - cpu0;
+    task.start_ms = duration<double, std::milli>(t0 - m_origin).count();
+    task.wall_ms = duration<double, std::milli>(t1 - t0).count();
+    task.ran_on_main = on_main;
+}
+
+void KStartupTasks::Run(unsigned int num_workers)
+{
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<TaskId> ready_main, ready_worker;
+    size_t remaining = m_tasks.size();
+
+    m_workers = num_workers;
+    m_origin = std::chrono::steady_clock::now();
+
+    for (TaskId id = 0; id < m_tasks.size(); ++id)
+    {
+        m_tasks[id].dependents.clear();
+    }
+    for (TaskId id = 0; id < m_tasks.size(); ++id)
+    {
+        s_task& task = m_tasks[id];
+        task.pending = task.deps.size();
+        for (TaskId dep : task.deps)
+        {
+            m_tasks[dep].dependents.push_back(id);
+        }
+        if (task.pending == 0)
+        {
+            (task.main_thread ? ready_main : ready_worker).push_back(id);
+        }
+    }
+
+    /* Called with the lock held once a phase has finished */
+    auto complete = [&](TaskId id) {
+        for (TaskId next : m_tasks[id].dependents)
+        {
+            if (--m_tasks[next].pending == 0)
+            {
+                (m_tasks[next].main_thread ? ready_main : ready_worker).push_back(next);
+            }
+        }
+        --remaining;
+        changed.notify_all();
+    };
+
+    auto worker = [&]() {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;)
+        {
+            changed.wait(guard, [&] { return !ready_worker.empty() || remaining == 0; });
+            if (remaining == 0)
+            {
+                return;
+            }
+            TaskId id = ready_worker.front();
+            ready_worker.pop_front();
+            guard.unlock();
+            Execute(m_tasks[id], false);
+            guard.lock();
+            complete(id);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned int i = 0; i < num_workers; ++i)
+    {
+        pool.emplace_back(worker);
+    }
+
+    /* The calling thread takes the main-thread phases, plus everything else
+     * when there are no workers.
+     */
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;)
+        {
+            changed.wait(guard, [&] {
+                return !ready_main.empty() || (num_workers == 0 && !ready_worker.empty()) || remaining == 0;
+            });
+            if (remaining == 0)
+            {
+                break;
+            }
+            std::deque<TaskId>& queue = ready_main.empty() ? ready_worker : ready_main;
+            TaskId id = queue.front();
+            queue.pop_front();
+            guard.unlock();
+            Execute(m_tasks[id], true);
+            guard.lock();
+            complete(id);
+        }
+    }
+
+    for (auto& thread : pool)
+    {
+        thread.join();
+    }
+    m_total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_origin).count();
+}
+
+void KStartupTasks::Report(FILE* out) const
+{
+    double cpu_total = 0.0;
+    fprintf(out, "Startup profile (%u worker thread%s)\n", m_workers, m_workers == 1 ? "" : "s");
+    fprintf(out, "  %-20s %-6s %10s %10s %10s\n", "phase", "thread", "start ms", "wall ms", "cpu ms");
+    for (const s_task& task : m_tasks)
+    {
+        fprintf(out, "  %-20s %-6s %10.2f %10.2f %10.2f\n", task.name.c_str(), task.ran_on_main ? "main" : "worker",
+                task.start_ms, task.wall_ms, task.cpu_ms);
+        cpu_total += task.cpu_ms;
+    }
+    fprintf(out, "  %-20s %-6s %10s %10.2f %10.2f\n", "total", "", "", m_total_ms, cpu_total);
+}
+
+unsigned int KStartupTasks::DefaultWorkers()
+{
+    /* The phases are small; more than a handful of threads only adds overhead */
+    unsigned int hw = std::thread::hardware_concurrency();
+    return std::min(std::max(hw, 2u) - 1, 3u);
+}
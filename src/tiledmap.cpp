@@ -1,3 +1,5 @@
+#include <array>
+#include <cstring>
 #include <map>
 #include <string>
 #include <tinyxml2.h>
@@ -11,11 +13,17 @@ using std::make_shared;
 #include "enums.h"
 #include "fade.h"
 #include "imgcache.h"
+#include "intrface.h"
 #include "kq.h"
+#include "mapcache.h"
+#include "mappreload.h"
 #include "platform.h"
 #include "structs.h"
 #include "tiledmap.h"
 #include <zlib.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 
 using std::map;
 using std::string;
@@ -24,6 +32,25 @@ using std::vector;
 using namespace tinyxml2;
 KTiledMap TiledMap;
 
+/*! Set while the preloader thread is loading a map. A broken map must not
+ * end the game from there; the preload is just thrown away instead.
+ */
+static thread_local bool* soft_errors = nullptr;
+
+/*! \brief Report a fatal problem with a map.
+ * \param message what went wrong
+ */
+static void map_error(const char* message)
+{
+    if (soft_errors)
+    {
+        TRACE("%s (while preloading)\n", message);
+        *soft_errors = true;
+        return;
+    }
+    Game.program_death(message);
+}
+
 // Compatibility as VC insists we use these for safety
 #ifdef _MSC_VER
 using stdext::make_checked_array_iterator;
@@ -71,28 +98,137 @@ uint32_t* end(tmx_layer& l)
  */
 void KTiledMap::load_tmx(const string& name)
 {
+    const string path = kqres(MAP_DIR, name + string(".tmx"));
+    const string previous = Game.GetCurmap();
+    tmx_map loaded_map;
     XMLDocument tmx;
-    string path = name + string(".tmx");
-    tmx.LoadFile(kqres(MAP_DIR, path).c_str());
-    if (tmx.Error())
+    // Start from the copy kept from an earlier visit, or else the preloaded
+    // map, or else the compiled copy if the TMX hasn't changed since it was made
+    const bool kept = find_template(name, loaded_map);
+    const bool cached = kept || MapPreloader.Take(name, loaded_map) || load_map_cache(path, loaded_map);
+    if (!cached)
     {
+        tmx.LoadFile(path.c_str());
+        if (tmx.Error())
+        {
 #ifdef WIN32
-        TRACE("Error loading %s\n%s\n%s\n", name.c_str(), tmx.GetErrorStr1(), tmx.GetErrorStr2());
+            TRACE("Error loading %s\n%s\n%s\n", name.c_str(), tmx.GetErrorStr1(), tmx.GetErrorStr2());
 #else
-        TRACE("Error loading %s\n%s\n", name.c_str(), tmx.ErrorStr());
+            TRACE("Error loading %s\n%s\n", name.c_str(), tmx.ErrorStr());
 #endif // WIN32
 
-        Game.program_death("Could not load map file ");
+            Game.program_death("Could not load map file ");
+        }
     }
-    Game.reset_timer_events();
+    reset_timers();
     if (hold_fade == 0)
     {
         do_transition(TRANS_FADE_OUT, 4);
     }
 
-    auto loaded_map = load_tmx_map(tmx.RootElement());
+    if (!cached)
+    {
+        loaded_map = load_tmx_map(tmx.RootElement());
+        save_map_cache(path, loaded_map);
+    }
+    if (!kept)
+    {
+        loaded_map.prepare();
+        add_template(name, loaded_map);
+    }
     loaded_map.set_current();
     Game.SetCurmap(name);
+    MapPreloader.Anticipate(name, previous, g_map.markers);
+}
+
+/** \brief Load a TMX format map without making it current.
+ * This is for the preloader thread: nothing global is touched, and
+ * problems with the map are reported by the return value rather than
+ * ending the game.
+ * \param name the filename
+ * \param map the loaded and prepared map
+ * \returns true if the map loaded without problems
+ */
+bool KTiledMap::preload_tmx(const string& name, tmx_map& map)
+{
+    const string path = kqres(MAP_DIR, name + string(".tmx"));
+    if (find_template(name, map))
+    {
+        return true;
+    }
+    bool failed = false;
+    soft_errors = &failed;
+    if (!load_map_cache(path, map))
+    {
+        XMLDocument tmx;
+        tmx.LoadFile(path.c_str());
+        if (tmx.Error())
+        {
+            failed = true;
+        }
+        else
+        {
+            map = load_tmx_map(tmx.RootElement());
+            if (!failed)
+            {
+                save_map_cache(path, map);
+            }
+        }
+    }
+    if (!failed)
+    {
+        map.prepare();
+    }
+    soft_errors = nullptr;
+    return !failed;
+}
+
+/*! Most map templates to keep; see find_template() */
+static const size_t MAX_TEMPLATES = 8;
+
+/** \brief Get a fresh copy of a map loaded before.
+ * Scripts change the map in play, but the template is kept as it was
+ * loaded. The copy shares the template's layers until it is changed.
+ * \param name the map name
+ * \param map the copy
+ * \returns true if there was a template for the map
+ */
+bool KTiledMap::find_template(const string& name, tmx_map& map)
+{
+    std::lock_guard<std::mutex> guard(template_lock);
+    for (auto it = templates.begin(); it != templates.end(); ++it)
+    {
+        if (it->first == name)
+        {
+            templates.splice(templates.begin(), templates, it);
+            map = tmx_map(it->second);
+            return true;
+        }
+    }
+    return false;
+}
+
+/** \brief Keep a pristine copy of a map.
+ * Only the most recently used few are kept.
+ * \param name the map name
+ * \param map the prepared map
+ */
+void KTiledMap::add_template(const string& name, const tmx_map& map)
+{
+    std::lock_guard<std::mutex> guard(template_lock);
+    for (auto it = templates.begin(); it != templates.end(); ++it)
+    {
+        if (it->first == name)
+        {
+            templates.erase(it);
+            break;
+        }
+    }
+    templates.emplace_front(name, map);
+    if (templates.size() > MAX_TEMPLATES)
+    {
+        templates.pop_back();
+    }
 }
 
 // Convert pointer-to-char to string,
@@ -218,12 +354,12 @@ KBounds KTiledMap::load_tmx_bounds(XMLElement const* el)
         {
             if (i->Attribute("type", "bounds"))
             {
-                auto new_bound = make_shared<KBound>();
-                new_bound->left = i->IntAttribute("x") / TILE_W;
-                new_bound->top = i->IntAttribute("y") / TILE_H;
-                new_bound->right = i->IntAttribute("width") / TILE_W + new_bound->left - 1;
-                new_bound->bottom = i->IntAttribute("height") / TILE_H + new_bound->top - 1;
-                new_bound->btile = 0;
+                KBound new_bound;
+                new_bound.left = i->IntAttribute("x") / TILE_W;
+                new_bound.top = i->IntAttribute("y") / TILE_H;
+                new_bound.right = i->IntAttribute("width") / TILE_W + new_bound.left - 1;
+                new_bound.bottom = i->IntAttribute("height") / TILE_H + new_bound.top - 1;
+                new_bound.btile = 0;
                 auto props = i->FirstChildElement("properties");
                 if (props)
                 {
@@ -232,7 +368,7 @@ KBounds KTiledMap::load_tmx_bounds(XMLElement const* el)
                     {
                         if (property->Attribute("name", "btile"))
                         {
-                            new_bound->btile = property->IntAttribute("value");
+                            new_bound.btile = property->IntAttribute("value");
                         }
                     }
                 }
@@ -287,6 +423,25 @@ KMarkers KTiledMap::load_tmx_markers(XMLElement const* el)
     return markers;
 }
 
+/*! \brief Convert little-endian words to host order, in place.
+ * TMX stores layer data as little-endian 32-bit GIDs, so this is a no-op
+ * on most machines.
+ * \param data the words
+ * \param count how many
+ */
+static void le32_to_host(uint32_t* data, size_t count)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (size_t i = 0; i < count; ++i)
+    {
+        data[i] = __builtin_bswap32(data[i]);
+    }
+#else
+    (void)data;
+    (void)count;
+#endif
+}
+
 /** \brief Fetch tile indices from a layer.
  * The numbers are GIDs as stored in the TMX file.
  * \param el the layer element
@@ -321,29 +476,21 @@ tmx_layer KTiledMap::load_tmx_layer(XMLElement const* el)
         vector<uint8_t> bytes = b64decode(data->GetText());
         if (data->Attribute("compression", "zlib"))
         {
-            vector<uint8_t> raw = uncompress(bytes);
-            if (raw.size() != layer.size * sizeof(uint32_t))
+            // Inflate straight into the layer; the size is known in advance
+            if (!uncompress(bytes, reinterpret_cast<uint8_t*>(layer.data.get()), layer.size * sizeof(uint32_t)))
             {
-                Game.program_death("Layer size mismatch");
-            }
-            auto iter = begin(raw);
-            for (auto& tile : layer)
-            {
-                uint32_t v = *iter++;
-                v |= (*iter++) << 8;
-                v |= (*iter++) << 16;
-                v |= (*iter++) << 24;
-                tile = v;
+                map_error("Layer size mismatch");
             }
+            le32_to_host(layer.data.get(), layer.size);
         }
         else
         {
-            Game.program_death("Layer's compression not supported");
+            map_error("Layer's compression not supported");
         }
     }
     else
     {
-        Game.program_death("Layer's encoding not supported");
+        map_error("Layer's encoding not supported");
     }
     return layer;
 }
@@ -488,37 +635,95 @@ vector<KQEntity> KTiledMap::load_tmx_entities(XMLElement const* el)
 
 /** \brief Load a tileset.
  * This can be from a standalone file or embedded in a map.
+ * Standalone files are only read once; see load_tsx().
  * \param el the <tileset> element
  * \returns the tileset
  */
 KTmxTileset KTiledMap::load_tmx_tileset(XMLElement const* el)
 {
     KTmxTileset tileset;
-    tileset.firstgid = el->IntAttribute("firstgid");
-    XMLElement const* tsx;
-    XMLDocument sourcedoc;
     auto source = el->Attribute("source");
     if (source)
     {
-        // Specified 'source' so it's an external tileset. Load it.
-        sourcedoc.LoadFile(kqres(MAP_DIR, source).c_str());
-        if (sourcedoc.Error())
-        {
+        // Specified 'source' so it's an external tileset.
+        tileset = load_tsx(source);
+    }
+    else
+    {
+        // No 'source' so it's internal; use the element itself
+        tileset = parse_tileset(el);
+    }
+    tileset.firstgid = el->IntAttribute("firstgid");
+    return tileset;
+}
+
+/** \brief Get an external tileset.
+ * Parsed tilesets are kept for the rest of the game, keyed by file name,
+ * so maps sharing a tileset don't load it again.
+ * The firstgid is not filled in, as that depends on the map.
+ * A tileset is only kept if it loaded completely: while preloading, its
+ * image may not be available yet, and the main thread must then load it
+ * (or stop the game) when the map is really entered.
+ * \param source the .tsx file name, relative to the maps directory
+ * \returns the tileset
+ */
+KTmxTileset KTiledMap::load_tsx(const string& source)
+{
+    std::lock_guard<std::mutex> guard(tsx_lock);
+    auto entry = tsx_registry.find(source);
+    if (entry != tsx_registry.end())
+    {
+        return entry->second;
+    }
+    XMLDocument sourcedoc;
+    sourcedoc.LoadFile(kqres(MAP_DIR, source).c_str());
+    if (sourcedoc.Error())
+    {
 #ifdef WIN32
-            TRACE("Error loading %s\n%s\n%s\n", source, sourcedoc.GetErrorStr1(), sourcedoc.GetErrorStr2());
+        TRACE("Error loading %s\n%s\n%s\n", source.c_str(), sourcedoc.GetErrorStr1(), sourcedoc.GetErrorStr2());
 #else
-            TRACE("Error loading %s\n%s\n", source, sourcedoc.ErrorStr());
+        TRACE("Error loading %s\n%s\n", source.c_str(), sourcedoc.ErrorStr());
 #endif // WIN32
-            Game.program_death("Couldn't load external tileset");
-        }
-        tsx = sourcedoc.RootElement();
+        map_error("Couldn't load external tileset");
+        return KTmxTileset();
     }
-    else
+    KTmxTileset tileset = parse_tileset(sourcedoc.RootElement());
+    tileset.source = source;
+    if (soft_errors && *soft_errors)
     {
-        // No 'source' so it's internal; use the element itself
-        tsx = el;
+        // Something went wrong in this preload, perhaps the image; the
+        // preload is thrown away, so don't keep a tileset which may be broken
+        return tileset;
     }
+    return tsx_registry.insert(std::make_pair(source, std::move(tileset))).first->second;
+}
 
+/** \brief Get the image for a tileset.
+ * When preloading, a missing image is only an error in the map.
+ * \param name the image file name
+ * \returns the image, or NULL when preloading and it couldn't be loaded
+ */
+Raster* KTiledMap::tileset_image(const string& name)
+{
+    if (!soft_errors)
+    {
+        return get_cached_image(name);
+    }
+    Raster* image = find_cached_image(name);
+    if (!image)
+    {
+        map_error("Error loading image.");
+    }
+    return image;
+}
+
+/** \brief Read the contents of a tileset.
+ * \param tsx the <tileset> element, from a .tsx file or embedded in a map
+ * \returns the tileset, without firstgid or source
+ */
+KTmxTileset KTiledMap::parse_tileset(XMLElement const* tsx)
+{
+    KTmxTileset tileset;
     auto name = tsx->Attribute("name");
     if (name)
     {
@@ -529,7 +734,7 @@ KTmxTileset KTiledMap::load_tmx_tileset(XMLElement const* el)
     tileset.sourceimage = image->Attribute("source");
     tileset.width = image->IntAttribute("width");
     tileset.height = image->IntAttribute("height");
-    tileset.imagedata = get_cached_image(tileset.sourceimage);
+    tileset.imagedata = tileset_image(tileset.sourceimage);
     // Get the animation data
     for (auto xtile = tsx->FirstChildElement("tile"); xtile; xtile = xtile->NextSiblingElement("tile"))
     {
@@ -574,128 +779,124 @@ tmx_map::tmx_map()
     , warpx(0)
     , warpy(0)
     , revision(1)
+    , prepared(false)
 {
 }
 
 static const uint16_t SHADOW_OFFSET = 200;
-/*! \brief Make this map the current one.
- * Make this map the one in play by copying its information into the
- * global structures. This function is the 'bridge' between the
- * TMX loader and the original KQ code.
+
+/*! \brief Turn a layer's GIDs into tile numbers.
+ * The narrowing is done in place (each output element is no bigger than
+ * the input one, so nothing is overwritten before it is read).
+ * \param layer the layer; its data is only useful through the result afterwards
+ * \param offset amount to subtract from non-zero GIDs
+ * \returns layer.size elements, in the layer's own storage
  */
-void tmx_map::set_current()
+template<typename T> static const T* narrow_layer(tmx_layer& layer, uint32_t offset)
 {
-    // general map properties
-    g_map.xsize = xsize;
-    g_map.ysize = ysize;
-    g_map.map_no = map_no;
-    g_map.can_save = can_save;
-    g_map.can_warp = can_warp;
-    g_map.pdiv = pdiv;
-    g_map.pmult = pmult;
-    g_map.map_mode = map_mode;
-    g_map.stx = stx;
-    g_map.sty = sty;
-    g_map.warpx = warpx;
-    g_map.warpy = warpy;
-    g_map.tileset = tileset;
-    g_map.use_sstone = use_sstone;
-    g_map.zero_zone = zero_zone;
-    g_map.map_desc = description;
-    g_map.song_file = song_file;
-    // Markers
-    g_map.markers = markers;
-    // Bounding boxes
-    g_map.bounds = bounds;
-    // Allocate space for layers
+    const uint32_t* src = layer.data.get();
+    unsigned char* dst = reinterpret_cast<unsigned char*>(layer.data.get());
+    for (int i = 0; i < layer.size; ++i)
+    {
+        uint32_t t = src[i];
+        if (t > 0)
+        {
+            t -= offset;
+        }
+        const T v = static_cast<T>(t);
+        memcpy(dst + i * sizeof(T), &v, sizeof(T));
+    }
+    return reinterpret_cast<const T*>(dst);
+}
+
+/*! \brief Convert the layers into the form the game uses.
+ * This can be done away from the main thread (see KMapPreloader) so
+ * set_current() only has to swap the result in.
+ * The TMX layers are not needed afterwards and are dropped.
+ */
+void tmx_map::prepare()
+{
+    if (prepared)
+    {
+        return;
+    }
+    grid.Resize(xsize, ysize);
     for (auto&& layer : layers)
     {
+        if (!layer.data || layer.size != xsize * ysize)
+        {
+            continue;
+        }
         if (layer.name == "map")
         {
             // map layers - these always have tile offset == 1
-            free(map_seg);
-            unsigned short* ptr = map_seg = static_cast<unsigned short*>(calloc(layer.size, sizeof(*map_seg)));
-            for (auto t : layer)
-            {
-                if (t > 0)
-                {
-                    --t;
-                }
-                *ptr++ = static_cast<unsigned short>(t);
-            }
+            grid.LoadTiles(MAP_LAYER_BTILE, narrow_layer<uint16_t>(layer, 1));
         }
         else if (layer.name == "bmap")
         {
-            free(b_seg);
-            unsigned short* ptr = b_seg = static_cast<unsigned short*>(calloc(layer.size, sizeof(*b_seg)));
-            for (auto t : layer)
-            {
-                if (t > 0)
-                {
-                    --t;
-                }
-                *ptr++ = t;
-            }
+            grid.LoadTiles(MAP_LAYER_MTILE, narrow_layer<uint16_t>(layer, 1));
         }
         else if (layer.name == "fmap")
         {
-            free(f_seg);
-            unsigned short* ptr = f_seg = static_cast<unsigned short*>(calloc(layer.size, sizeof(*f_seg)));
-            for (auto t : layer)
-            {
-                if (t > 0)
-                {
-                    --t;
-                }
-                *ptr++ = t;
-            }
+            grid.LoadTiles(MAP_LAYER_FTILE, narrow_layer<uint16_t>(layer, 1));
         }
         else if (layer.name == "shadows")
         {
             // Shadows
-            unsigned short shadow_offset = find_tileset("misc").firstgid + SHADOW_OFFSET;
-            free(s_seg);
-            auto sptr = s_seg = static_cast<unsigned char*>(calloc(layer.size, sizeof(*s_seg)));
-            for (auto t : layer)
-            {
-                if (t > 0)
-                {
-                    t -= shadow_offset;
-                }
-                *sptr++ = static_cast<unsigned char>(t);
-            }
+            grid.LoadAttributes(MAP_LAYER_SHADOW,
+                                narrow_layer<uint8_t>(layer, find_tileset("misc").firstgid + SHADOW_OFFSET));
         }
         else if (layer.name == "obstacles")
         {
             // Obstacles
-            unsigned short obstacle_offset = find_tileset("obstacles").firstgid - 1;
-            free(o_seg);
-            auto sptr = o_seg = static_cast<unsigned char*>(calloc(layer.size, sizeof(*o_seg)));
-
-            for (auto t : layer)
-            {
-                if (t > 0)
-                {
-                    t -= obstacle_offset;
-                }
-                *sptr++ = static_cast<unsigned char>(t);
-            }
+            grid.LoadAttributes(MAP_LAYER_OBSTACLE,
+                                narrow_layer<uint8_t>(layer, find_tileset("obstacles").firstgid - 1));
         }
     }
+    layers.clear();
+    bounds.Index(xsize, ysize);
 
     // Zones
-    free(z_seg);
-    z_seg = static_cast<unsigned char*>(calloc(xsize * ysize, sizeof(unsigned char)));
     for (auto&& zone : zones)
     {
-        for (int i = 0; i < zone.w; ++i)
-        {
-            for (int j = 0; j < zone.h; ++j)
-            {
-                z_seg[(i + zone.x) + xsize * (j + zone.y)] = zone.n;
-            }
-        }
+        grid.Fill(MAP_LAYER_ZONE, zone.x, zone.y, zone.w, zone.h, zone.n);
     }
+    prepared = true;
+}
+
+/*! \brief Make this map the current one.
+ * Make this map the one in play by moving its information into the
+ * global structures. This function is the 'bridge' between the
+ * TMX loader and the original KQ code.
+ * The map grid is swapped in, so this map holds the old one afterwards.
+ */
+void tmx_map::set_current()
+{
+    // general map properties
+    g_map.xsize = xsize;
+    g_map.ysize = ysize;
+    g_map.map_no = map_no;
+    g_map.can_save = can_save;
+    g_map.can_warp = can_warp;
+    g_map.pdiv = pdiv;
+    g_map.pmult = pmult;
+    g_map.map_mode = map_mode;
+    g_map.stx = stx;
+    g_map.sty = sty;
+    g_map.warpx = warpx;
+    g_map.warpy = warpy;
+    g_map.tileset = tileset;
+    g_map.use_sstone = use_sstone;
+    g_map.zero_zone = zero_zone;
+    g_map.map_desc = description;
+    g_map.song_file = song_file;
+    // Markers
+    g_map.markers = markers;
+    // Bounding boxes
+    g_map.bounds = bounds;
+    // Layers
+    prepare();
+    std::swap(MapGrid, grid);
 
     // Entities
     memset(&g_ent[PSIZE], 0, (MAX_ENTITIES - PSIZE) * sizeof(KQEntity));
@@ -722,189 +923,217 @@ const KTmxTileset& tmx_map::find_tileset(const string& name) const
             return ans;
     }
     // not found
+    static const KTmxTileset none;
     TRACE("Tileset '%s' not found in map.\n", name.c_str());
-    Game.program_death("No such tileset");
-}
-
-/*! \brief BASE64 scanner.
- * This iterates through some BASE64 characters, returning
- * each 6-bit segment in turn.
- * If it gets an '=' character it returns PAD.
- * It ignores whitespace.
- * Any other characters return ERROR and set the
- * error bit.
- * When it reaches the end of the string it returns
- * PAD forever
+    map_error("No such tileset");
+    return none;
+}
+
+/*! \brief BASE64 character classes.
+ * Entries 0..63 are the 6-bit value of a valid character; the others are
+ * the special classes below.
+ */
+namespace b64
+{
+static const uint8_t PAD = 0x40;
+static const uint8_t SPACE = 0x80;
+static const uint8_t INVALID = 0xff;
+
+/*! \brief Build the 256-entry decode table.
+ * \returns the table, indexed by input character
  */
-struct b64
+static std::array<uint8_t, 256> make_table()
 {
-    b64(const char* _ptr)
-        : ptr(_ptr)
-        , errbit(false)
+    static const char validchars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                     "abcdefghijklmnopqrstuvwxyz"
+                                     "0123456789"
+                                     "+/";
+    std::array<uint8_t, 256> table;
+    table.fill(INVALID);
+    for (uint8_t i = 0; i < 64; ++i)
     {
-        while (isspace(*ptr))
-        {
-            ++ptr;
-        }
+        table[static_cast<uint8_t>(validchars[i])] = i;
     }
-    uint8_t operator()()
+    table['='] = PAD;
+    for (unsigned char c : { ' ', '\t', '\n', '\v', '\f', '\r' })
     {
-        if (ptr)
+        table[c] = SPACE;
+    }
+    return table;
+}
+static const std::array<uint8_t, 256> table = make_table();
+
+/*! \brief Copy the input without any whitespace.
+ * Tiled writes the data as one long run surrounded by (and sometimes split
+ * by) line breaks, so whole runs are copied at once.
+ * \param text the input characters
+ * \returns the characters with whitespace removed
+ */
+static string strip(const char* text)
+{
+    string out;
+    out.reserve(strlen(text));
+    const char* ptr = text;
+    while (*ptr)
+    {
+        while (table[static_cast<uint8_t>(*ptr)] == SPACE)
         {
-            const char* pos = strchr(validchars, *ptr++);
-            while (isspace(*ptr))
-            {
-                ++ptr;
-            }
-            if (*ptr == 0)
-            {
-                ptr = nullptr;
-            }
-            if (pos)
-            {
-                return static_cast<uint8_t>(pos - validchars);
-            }
-            else
-            {
-                errbit = true;
-                ptr = nullptr;
-                return ERROR;
-            }
+            ++ptr;
         }
-        else
+        const char* run = ptr;
+        while (*ptr && table[static_cast<uint8_t>(*ptr)] != SPACE)
         {
-            return PAD;
+            ++ptr;
         }
+        out.append(run, ptr - run);
     }
-    bool error() const
-    {
-        return errbit;
-    }
-    void seterror()
-    {
-        errbit = true;
-    }
-    operator bool() const
+    return out;
+}
+
+#ifdef __SSSE3__
+/*! \brief Decode 16 characters into 12 bytes with SSSE3.
+ * Uses nibble lookups to validate and translate all 16 characters at once,
+ * then packs the 6-bit values together. Writes 16 bytes to out (the last 4
+ * are junk) so the caller must leave room.
+ * \param in 16 input characters
+ * \param out the output, with room for 16 bytes
+ * \returns false if any character was not in the BASE64 alphabet
+ */
+static bool decode16(const char* in, uint8_t* out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B,
+                                         0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                         0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+    const __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+    const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    // A character is valid if its high and low nibble classes share no bits
+    const __m128i bad = _mm_and_si128(lo, hi);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xffff)
     {
-        return ptr != nullptr;
+        return false;
     }
-    static const char* validchars;
-    static const uint8_t PAD = 0x40;
-    static const uint8_t ERROR = 0xff;
-    const char* ptr;
-    bool errbit;
-};
-const char* b64::validchars = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                              "abcdefghijklmnopqrstuvwxyz"
-                              "0123456789"
-                              "+/=";
-/// Return true if a byte is a valid 6-bit block.
-static bool valid(uint8_t v)
-{
-    return v < b64::PAD;
+    const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+    const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    const __m128i values = _mm_add_epi8(str, roll);
+
+    // Pack four 6-bit values into 24 bits, then squeeze out the gaps
+    const __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    const __m128i shuffled =
+        _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), shuffled);
+    return true;
 }
+#endif
+} // namespace b64
 
 /*! \brief Decode BASE64.
  * Convert a string of characters into a vector of bytes.
+ * Whitespace is ignored and trailing padding is optional.
  * If there is an error, returns an empty vector.
  * \param text the input characters
  * \returns the converted bytes
  */
 vector<uint8_t> KTiledMap::b64decode(const char* text)
 {
-    vector<uint8_t> data;
-    b64 nextc(text);
-    while (nextc)
+    const string chars = b64::strip(text);
+    size_t length = chars.size();
+    size_t pads = 0;
+    while (length > 0 && pads < 2 && chars[length - 1] == '=')
     {
-        uint8_t b0 = nextc();
-        if (valid(b0))
-        {
-            uint8_t b1 = nextc();
-            if (valid(b1))
-            {
-                data.push_back(b0 << 2 | b1 >> 4);
-                uint8_t b2 = nextc();
-                if (valid(b2))
-                {
-                    data.push_back(b1 << 4 | b2 >> 2);
-                    uint8_t b3 = nextc();
-                    if (valid(b3))
-                    {
-                        data.push_back(b2 << 6 | b3);
-                    }
-                }
-                else
-                {
-                    //  if b2 is pad then b3 has to be too.
-                    if (b2 == b64::PAD && nextc() != b64::PAD)
-                    {
-                        nextc.seterror();
-                    }
-                }
-            }
-            else
-            {
-                //  if b1 is pad this is an error
-                nextc.seterror();
-            }
-        }
-        else
-        {
-            // if b0 is pad this is an error
-            nextc.seterror();
-        }
+        --length;
+        ++pads;
     }
-    if (!nextc.error())
+    const size_t tail = length % 4;
+    // One character left over can't make a byte, and padding is only
+    // allowed to finish off a partial group.
+    if (tail == 1 || (pads > 0 && tail == 0))
     {
-        return data;
+        return vector<uint8_t>();
     }
-    else
+
+    const size_t outsize = length / 4 * 3 + (tail ? tail - 1 : 0);
+    // 4 bytes slack for the bulk decoder, which writes 16 bytes at a time
+    vector<uint8_t> data(outsize + 4);
+    const auto& table = b64::table;
+    const char* in = chars.data();
+    const char* end = in + length;
+    uint8_t* out = data.data();
+
+#ifdef __SSSE3__
+    while (end - in >= 16 && b64::decode16(in, out))
     {
-        return vector<uint8_t>();
+        in += 16;
+        out += 12;
+    }
+#endif
+    // Whole groups of four
+    while (end - in >= 4)
+    {
+        const uint8_t b0 = table[static_cast<uint8_t>(in[0])];
+        const uint8_t b1 = table[static_cast<uint8_t>(in[1])];
+        const uint8_t b2 = table[static_cast<uint8_t>(in[2])];
+        const uint8_t b3 = table[static_cast<uint8_t>(in[3])];
+        if ((b0 | b1 | b2 | b3) >= b64::PAD)
+        {
+            return vector<uint8_t>();
+        }
+        *out++ = b0 << 2 | b1 >> 4;
+        *out++ = b1 << 4 | b2 >> 2;
+        *out++ = b2 << 6 | b3;
+        in += 4;
     }
+    // Final partial group of two or three characters
+    if (tail)
+    {
+        const uint8_t b0 = table[static_cast<uint8_t>(in[0])];
+        const uint8_t b1 = table[static_cast<uint8_t>(in[1])];
+        const uint8_t b2 = tail == 3 ? table[static_cast<uint8_t>(in[2])] : 0;
+        if ((b0 | b1 | b2) >= b64::PAD)
+        {
+            return vector<uint8_t>();
+        }
+        *out++ = b0 << 2 | b1 >> 4;
+        if (tail == 3)
+        {
+            *out++ = b1 << 4 | b2 >> 2;
+        }
+    }
+    data.resize(outsize);
+    return data;
 }
 
 /*! \brief Uncompress a sequence of bytes.
- * Uses the zlib to uncompress.
+ * Uses the zlib to uncompress, in one call, into a buffer of the
+ * expected size.
  * \param data the input compressed data
- * \returns the uncompressed data
+ * \param out where to put the uncompressed data
+ * \param size the expected size of the uncompressed data
+ * \returns true if exactly size bytes were uncompressed
  */
-vector<uint8_t> KTiledMap::uncompress(const vector<uint8_t>& data)
+bool KTiledMap::uncompress(const vector<uint8_t>& data, uint8_t* out, size_t size)
 {
     z_stream stream;
-    vector<uint8_t> out;
     stream.zalloc = Z_NULL;
     stream.zfree = Z_NULL;
     stream.opaque = Z_NULL;
     stream.avail_in = data.size();
     stream.next_in = reinterpret_cast<z_const Bytef*>(data.data());
-
-    if (inflateInit(&stream) == Z_OK)
+    if (inflateInit(&stream) != Z_OK)
     {
-        uint8_t buffer[256];
-        stream.avail_out = sizeof(buffer);
-        stream.next_out = buffer;
-        while (true)
-        {
-            int rc = inflate(&stream, Z_NO_FLUSH);
-            if (rc < 0)
-            {
-                // Error
-                out.clear();
-                break;
-            }
-            if (stream.avail_out < sizeof(buffer))
-            {
-                std::copy(buffer, buffer + sizeof(buffer) - stream.avail_out, back_inserter(out));
-                stream.avail_out = sizeof(buffer);
-                stream.next_out = buffer;
-            }
-            if (rc == Z_STREAM_END)
-            {
-                break;
-            };
-        }
-        inflateEnd(&stream);
+        return false;
     }
-    return out;
+    stream.avail_out = size;
+    stream.next_out = out;
+    int rc = inflate(&stream, Z_FINISH);
+    bool ok = rc == Z_STREAM_END && stream.avail_out == 0;
+    inflateEnd(&stream);
+    return ok;
 }
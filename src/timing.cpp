@@ -32,6 +32,7 @@
 #include <winalleg.h>
 #endif
 
+#include "intrface.h"
 #include "kq.h"
 #include "music.h"
 #include "timing.h"
@@ -90,6 +91,13 @@ int limit_frame_rate(int fps)
     time_t seconds;
 
     gettimeofday(&tv, 0);
+    if (last_exec.tv_sec)
+    {
+        /* Collect Lua garbage first, and only sleep through what is left */
+        collect_script_garbage(last_exec.tv_usec - tv.tv_usec + (1000000 / fps) +
+                               1000000 * (last_exec.tv_sec - tv.tv_sec));
+        gettimeofday(&tv, 0);
+    }
     /* The time between now and (last exec + delay) */
     timeout.tv_usec = last_exec.tv_usec - tv.tv_usec + (1000000 / fps) + 1000000 * (last_exec.tv_sec - tv.tv_sec);
     seconds = last_exec.tv_sec;
@@ -153,6 +161,10 @@ int limit_frame_rate(int fps)
     }
     DWORD next_exec = last_exec + 1000 / fps;
 
+    // Collect Lua garbage first, and only sleep through what is left.
+    collect_script_garbage(now < next_exec ? (next_exec - now) * 1000L : 0);
+    now = GetTickCount();
+
     // Sleep if current time is before next due time.
     if (now < next_exec)
     {
@@ -192,6 +204,7 @@ int limit_frame_rate(int fps)
     fps = fps; // prevent "unused param" warnings
     static int last_ksec = 0;
 
+    collect_script_garbage(0);
     vsync();
     ++frate;
     if (last_ksec != ksec)
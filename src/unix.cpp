@@ -147,6 +147,8 @@ const string kqres(enum eDirectories dir, const string file)
             user_dir = string(home) + string("/.kq");
             /* Always try to make the directory, just to be sure. */
             mkdir(user_dir.c_str(), 0755);
+            /* Somewhere to keep files derived from the game data */
+            mkdir((user_dir + "/cache").c_str(), 0755);
         }
         else
         {
@@ -176,6 +178,9 @@ const string kqres(enum eDirectories dir, const string file)
     case SCRIPT_DIR:
         return get_lua_file_path(lib_dir, file);
         break;
+    case CACHE_DIR:
+        return user_dir + "/cache/" + file;
+        break;
     default:
         return NULL;
     }
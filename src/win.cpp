@@ -157,6 +157,8 @@ const string kqres(eDirectories dir, string file)
             sprintf(user_dir, "%s\\KQ", home);
             /* Always try to make the directory, just to be sure. */
             _mkdir(user_dir);
+            /* Somewhere to keep files derived from the game data */
+            _mkdir((string(user_dir) + "\\cache").c_str());
         }
         else
         {
@@ -185,6 +187,9 @@ const string kqres(eDirectories dir, string file)
     case SCRIPT_DIR:
         return get_lua_file_path(file);
         break;
+    case CACHE_DIR:
+        return string(user_dir) + "\\cache\\" + file;
+        break;
     default:
         return NULL;
     }